@@ -1,18 +1,543 @@
 #include <iostream>
 #include "permute_cpu.h"
 #include "permute_gpu.h"
+#include "permute_view.h"
 
-void test_cpu_permute() {
+bool test_cpu_permute() {
   int W = 3, H = 3, CI = 9, CO = 2;
-  size_t buff_isize = CO * CI * H * W;
-  float *arr = new float[buff_isize/4];
-  for (int i = 0; i < buff_isize / 4; ++i) {
+  int CI4 = Tensor::CeilDiv(CI, 4);
+  // the packed src holds the channel tail as well
+  size_t buff_isize = CO * CI4 * 4 * H * W;
+  float *arr = new float[buff_isize];
+  for (size_t i = 0; i < buff_isize; ++i) {
     arr[i] = i * 1.0;
   }
   Tensor::PermuteCPU cpu_permuter;
   float *outarr = cpu_permuter.DoPermute("nh|c4w4", "nchw", {CO, CI, H, W}, arr);
+  bool pass = outarr != nullptr;
+  for (int n = 0; n < CO && pass; ++n) {
+    for (int c = 0; c < CI; ++c) {
+      for (int h = 0; h < H; ++h) {
+        for (int w = 0; w < W; ++w) {
+          float expect = arr[(((n * H + h) * CI4 + c / 4) * W + w) * 4 + c % 4];
+          if (outarr[((n * CI + c) * H + h) * W + w] != expect) {
+            pass = false;
+          }
+        }
+      }
+    }
+  }
+  if (!pass) {
+    std::cout << "test_cpu_permute failed\n";
+  }
+  delete[] arr;
+  delete[] outarr;
+  return pass;
+}
+// every kernel variant, Generic is the reference
+std::vector<Tensor::PermuteKernelConfig> kernel_variants() {
+  std::vector<Tensor::PermuteKernelConfig> configs;
+  Tensor::PermuteKernelConfig config;
+  config.kernel = Tensor::PermuteKernel::Generic;
+  configs.push_back(config);
+  config.kernel = Tensor::PermuteKernel::Incremental;
+  configs.push_back(config);
+  config.kernel = Tensor::PermuteKernel::Tiled;
+  for (int tile : {3, 16}) {
+    config.tile = tile;
+    configs.push_back(config);
+  }
+  config.kernel = Tensor::PermuteKernel::Threaded;
+  config.threads = 3;
+  for (int tile : {0, 2}) {
+    config.tile = tile;
+    configs.push_back(config);
+  }
+  return configs;
+}
+
+// permute with every kernel variant forced through the tuning database, they
+// must write the same dst as Generic, including the tail and the halo
+bool check_kernel_variants(std::string from, std::string to,
+                           const std::vector<int> &src_shape, size_t src_size,
+                           size_t dst_size, const std::string &tuning_key,
+                           const Tensor::PaddingAttribute &padding =
+                               Tensor::PaddingAttribute()) {
+  std::vector<float> src(src_size);
+  for (size_t i = 0; i < src_size; ++i) {
+    src[i] = i * 1.0;
+  }
+  std::vector<float> reference;
+  for (const Tensor::PermuteKernelConfig &config : kernel_variants()) {
+    Tensor::PermuteTuner tuner;
+    tuner.set_online(false);
+    for (int bucket = 0; bucket < 32; ++bucket) {
+      tuner.Record(tuning_key, size_t(1) << bucket, config);
+    }
+    Tensor::PermuteCPU cpu_permuter;
+    cpu_permuter.SetTuner(&tuner);
+    std::vector<float> dst(dst_size, -77.f);
+    if (cpu_permuter.DoPermute(from, to, src_shape, src.data(),
+                               Tensor::StridedMemory(), dst.data(),
+                               Tensor::StridedMemory(), padding) != 0) {
+      std::cout << from << "->" << to << " failed\n";
+      return false;
+    }
+    if (reference.empty()) {
+      reference = dst;
+    } else if (dst != reference) {
+      std::cout << from << "->" << to << " kernel "
+                << static_cast<int>(config.kernel) << " tile " << config.tile
+                << " mismatch Generic\n";
+      return false;
+    }
+  }
+  return true;
+}
+
+bool test_cpu_kernel_variants() {
+  int N = 2, C = 6, H = 3, W = 5;
+  int C4 = Tensor::CeilDiv(C, 4);
+  size_t plain = N * C * H * W, packed = N * C4 * H * W * 4;
+  Tensor::PaddingAttribute padding;
+  padding.before = {0, 0, 1, 2};
+  padding.after = {0, 0, 2, 1};
+  padding.value = -2.f;
+  Tensor::PaddingAttribute edge = padding;
+  edge.mode = Tensor::PadMode::Edge;
+  size_t padded = N * C4 * (H + 3) * (W + 3) * 4;
+  bool pass = true;
+  pass &= check_kernel_variants("nchw", "nc4hw4", {N, C, H, W}, plain, packed,
+                                "nchw->nc4hw4");
+  pass &= check_kernel_variants("nc4hw4", "nchw", {N, C, H, W}, packed, plain,
+                                "nc4hw4->nchw");
+  pass &= check_kernel_variants("nc4hw4", "nhc4w4", {N, C4, H, W, 4}, packed,
+                                packed, "nc4hw4->nhc4w4");
+  pass &= check_kernel_variants("nchw", "nhwc", {N, C, H, W}, plain, plain,
+                                "nchw->nhwc");
+  pass &= check_kernel_variants("nchw", "nc4hw4", {N, C, H, W}, plain, padded,
+                                "nchw->nc4hw4;pad", padding);
+  pass &= check_kernel_variants("nchw", "nc4hw4", {N, C, H, W}, plain, padded,
+                                "nchw->nc4hw4;pad", edge);
+  if (!pass) {
+    std::cout << "test_cpu_kernel_variants failed\n";
+  }
+  return pass;
+}
+
+// a view must read the same as the materialized permute, element by element
+// and box by box
+bool check_view(std::string from, std::string to,
+                const std::vector<int> &src_shape, size_t src_size,
+                const Tensor::PaddingAttribute &padding =
+                    Tensor::PaddingAttribute(),
+                const Tensor::EpilogueAttribute &epilogue =
+                    Tensor::EpilogueAttribute()) {
+  std::vector<float> src(src_size);
+  for (size_t i = 0; i < src_size; ++i) {
+    src[i] = i * 1.0;
+  }
+  Tensor::PermuteCPU cpu_permuter;
+  Tensor::PermutedView view(cpu_permuter, from, to, src_shape, src.data(),
+                            Tensor::StridedMemory(), padding, epilogue);
+  if (!view.valid()) {
+    std::cout << from << "->" << to << " invalid view\n";
+    return false;
+  }
+  const std::vector<int32_t> &shape = view.shape();
+  std::vector<int32_t> stride = Tensor::getStride(shape);
+  size_t dst_size = Tensor::arrayProduct(shape);
+  std::vector<float> full(dst_size, -77.f);
+  if (cpu_permuter.DoPermute(from, to, src_shape, src.data(),
+                             Tensor::StridedMemory(), full.data(),
+                             Tensor::StridedMemory(), padding, epilogue) != 0) {
+    return false;
+  }
+  std::vector<float> materialized(dst_size, -77.f);
+  if (view.Materialize(materialized.data()) != 0 || materialized != full) {
+    std::cout << from << "->" << to << " view Materialize mismatch\n";
+    return false;
+  }
+  // the inner box, one element off every border
+  std::vector<int32_t> start(shape.size()), extent(shape.size());
+  for (size_t i = 0; i < shape.size(); ++i) {
+    start[i] = shape[i] > 2 ? 1 : 0;
+    extent[i] = shape[i] > 2 ? shape[i] - 2 : shape[i];
+  }
+  std::vector<float> tile(Tensor::arrayProduct(extent), -77.f);
+  if (view.Materialize(start, extent, tile.data()) != 0) {
+    return false;
+  }
+  std::vector<int32_t> tile_stride = Tensor::getStride(extent);
+  for (size_t i = 0; i < dst_size; ++i) {
+    std::vector<int32_t> index(shape.size());
+    size_t remain = i;
+    bool in_box = true;
+    int32_t tile_offset = 0;
+    for (int32_t d = shape.size() - 1; d >= 0; --d) {
+      index[d] = remain % shape[d];
+      remain /= shape[d];
+      in_box &= index[d] >= start[d] && index[d] < start[d] + extent[d];
+      tile_offset += (index[d] - start[d]) * tile_stride[d];
+    }
+    if (view.At(index) != full[Tensor::stridedOffset(index, stride)] ||
+        (in_box && tile[tile_offset] != view.At(index))) {
+      std::cout << from << "->" << to << " view mismatch at " << i << "\n";
+      return false;
+    }
+  }
+  return true;
+}
+
+bool test_cpu_view() {
+  int N = 2, C = 6, H = 3, W = 5;
+  int C4 = Tensor::CeilDiv(C, 4);
+  size_t plain = N * C * H * W, packed = N * C4 * H * W * 4;
+  Tensor::PaddingAttribute padding;
+  padding.before = {0, 0, 1, 2};
+  padding.after = {0, 0, 2, 1};
+  padding.value = -2.f;
+  bool pass = true;
+  pass &= check_view("nchw", "nc4hw4", {N, C, H, W}, plain);
+  pass &= check_view("nc4hw4", "nchw", {N, C, H, W}, packed);
+  pass &= check_view("nc4hw4", "nhc4w4", {N, C4, H, W, 4}, packed);
+  pass &= check_view("nchw", "nhwc", {N, C, H, W}, plain);
+  pass &= check_view("nchw", "nc4hw4", {N, C, H, W}, plain, padding);
+  // the view applies the epilogue on read, with the same channel as the
+  // permute, the edge halo included
+  Tensor::EpilogueAttribute epilogue;
+  epilogue.Scale({1, 2, 3, 4, 5, 6}).Bias({-9}).Relu();
+  Tensor::EpilogueAttribute lanes;
+  lanes.Normalize({1, 2, 3, 4, 5, 6, 7, 8}, {2, 2, 2, 2, 4, 4, 4, 4});
+  Tensor::EpilogueAttribute rows;
+  rows.axis = 'H';
+  rows.Bias({10, 20, 30});
+  Tensor::PaddingAttribute edge = padding;
+  edge.mode = Tensor::PadMode::Edge;
+  pass &= check_view("nchw", "nc4hw4", {N, C, H, W}, plain,
+                     Tensor::PaddingAttribute(), epilogue);
+  pass &= check_view("nc4hw4", "nhwc", {N, H, W, C}, packed,
+                     Tensor::PaddingAttribute(), epilogue);
+  pass &= check_view("nc4hw4", "nhc4w4", {N, C4, H, W, 4}, packed,
+                     Tensor::PaddingAttribute(), lanes);
+  pass &= check_view("nchw", "nc4hw4", {N, C, H, W}, plain, edge, rows);
+  if (!pass) {
+    std::cout << "test_cpu_view failed\n";
+  }
+  return pass;
+}
+
+// a box update must write the full permute inside the box and nothing
+// outside it. dst_shape is in dst tensor dims, the non-packed ones when
+// unpacking
+bool check_box(std::string from, std::string to,
+               const std::vector<int> &src_shape, size_t src_size,
+               const std::vector<int32_t> &dst_shape,
+               const std::vector<int32_t> &start,
+               const std::vector<int32_t> &extent) {
+  std::vector<float> src(src_size);
+  for (size_t i = 0; i < src_size; ++i) {
+    src[i] = i * 1.0;
+  }
+  Tensor::PermuteCPU cpu_permuter;
+  size_t dst_size = Tensor::arrayProduct(dst_shape);
+  std::vector<float> full(dst_size, -77.f), boxed(dst_size, -77.f);
+  if (cpu_permuter.DoPermute(from, to, src_shape, src.data(),
+                             Tensor::StridedMemory(), full.data(),
+                             Tensor::StridedMemory()) != 0 ||
+      cpu_permuter.DoPermute(from, to, src_shape, src.data(), boxed.data(),
+                             start, extent) != 0) {
+    std::cout << from << "->" << to << " box permute failed\n";
+    return false;
+  }
+  for (size_t i = 0; i < dst_size; ++i) {
+    size_t remain = i;
+    bool in_box = true;
+    for (int32_t d = dst_shape.size() - 1; d >= 0; --d) {
+      int32_t index = remain % dst_shape[d];
+      remain /= dst_shape[d];
+      in_box &= index >= start[d] && index < start[d] + extent[d];
+    }
+    if (boxed[i] != (in_box ? full[i] : -77.f)) {
+      std::cout << from << "->" << to << " box mismatch at " << i << "\n";
+      return false;
+    }
+  }
+  return true;
+}
+
+bool test_cpu_box() {
+  int N = 2, C = 6, H = 4, W = 5;
+  int C4 = Tensor::CeilDiv(C, 4);
+  size_t plain = N * C * H * W, packed = N * C4 * H * W * 4;
+  bool pass = true;
+  pass &= check_box("nchw", "nc4hw4", {N, C, H, W}, plain, {N, C4, H, W, 4},
+                    {1, 1, 1, 2, 0}, {1, 1, 2, 2, 4});
+  pass &= check_box("nc4hw4", "nchw", {N, C, H, W}, packed, {N, C, H, W},
+                    {0, 1, 1, 0}, {2, 4, 2, 3});
+  pass &= check_box("nchw", "nhwc", {N, C, H, W}, plain, {N, H, W, C},
+                    {1, 0, 1, 2}, {1, 3, 3, 3});
+  if (!pass) {
+    std::cout << "test_cpu_box failed\n";
+  }
+  return pass;
 }
+
+// a fan-out must write the same dsts as separate permutes, and walk every
+// element once, expect_walked is the sum of dst sizes, or of the packed src
+// size for an unpacking dst. dst_sizes are the dense sizes of dsts
+bool check_fanout(std::string from, const std::vector<std::string> &tos,
+                  const std::vector<int> &src_shape, size_t src_size,
+                  const std::vector<std::vector<int>> &plan_shapes,
+                  const std::vector<size_t> &dst_sizes, size_t expect_walked) {
+  std::vector<float> src(src_size);
+  for (size_t i = 0; i < src_size; ++i) {
+    src[i] = i * 1.0;
+  }
+  Tensor::PermuteCPU cpu_permuter;
+  std::vector<std::vector<float>> outs;
+  std::vector<float *> dsts;
+  for (size_t i = 0; i < tos.size(); ++i) {
+    outs.emplace_back(dst_sizes[i], -77.f);
+  }
+  for (auto &out : outs) {
+    dsts.push_back(out.data());
+  }
+  size_t walked = 0;
+  if (cpu_permuter.DoPermute(from, tos, src_shape, src.data(), dsts,
+                             &walked) != 0) {
+    std::cout << from << " fan-out failed\n";
+    return false;
+  }
+  if (walked != expect_walked) {
+    std::cout << from << " fan-out walked " << walked << " elements for "
+              << expect_walked << "\n";
+    return false;
+  }
+  for (size_t i = 0; i < tos.size(); ++i) {
+    std::vector<float> single(dst_sizes[i], -77.f);
+    if (cpu_permuter.DoPermute(from, tos[i], plan_shapes[i], src.data(),
+                               Tensor::StridedMemory(), single.data(),
+                               Tensor::StridedMemory()) != 0 ||
+        single != outs[i]) {
+      std::cout << from << "->" << tos[i] << " fan-out mismatch\n";
+      return false;
+    }
+  }
+  return true;
+}
+
+bool test_cpu_fanout() {
+  // H * W is bigger than a tile, so tiles are cut on H inside c4 blocks
+  int N = 1, C = 6, H = 256, W = 512;
+  int C4 = Tensor::CeilDiv(C, 4);
+  size_t plain = N * C * H * W, packed = N * C4 * H * W * 4;
+  size_t full = N * 8 * H * W;
+  bool pass = true;
+  pass &= check_fanout("nchw", {"nhwc", "nc4hw4"}, {N, C, H, W}, plain,
+                       {{N, C, H, W}, {N, C, H, W}}, {plain, packed},
+                       plain + packed);
+  pass &= check_fanout("nchw", {"nc4hw4"}, {N, 8, H, W}, full,
+                       {{N, 8, H, W}}, {full}, full);
+  pass &= check_fanout("nc4hw4", {"nchw", "nhc4w4"}, {N, C, H, W}, packed,
+                       {{N, C, H, W}, {N, C4, H, W, 4}}, {plain, packed},
+                       packed + packed);
+  if (!pass) {
+    std::cout << "test_cpu_fanout failed\n";
+  }
+  return pass;
+}
+
+// padding and a fused epilogue in one allocating permute, the epilogue
+// touches neither the halo nor the packing tail
+bool test_cpu_epilogue() {
+  int N = 2, C = 6, H = 3, W = 5;
+  int C4 = Tensor::CeilDiv(C, 4);
+  std::vector<float> src(N * C * H * W);
+  for (size_t i = 0; i < src.size(); ++i) {
+    src[i] = i * 1.0 - 90;
+  }
+  std::vector<float> scale = {1, 2, 3, 4, 5, 6};
+  Tensor::PermuteOptions options;
+  options.padding.before = {0, 0, 1, 0};
+  options.padding.after = {0, 0, 1, 0};
+  options.padding.value = -2.f;
+  options.epilogue.Scale(scale).Bias({1}).Relu();
+  Tensor::PermuteCPU cpu_permuter;
+  float *outarr =
+      cpu_permuter.DoPermute("nchw", "nc4hw4", {N, C, H, W}, src.data(), options);
+  bool pass = outarr != nullptr;
+  int HP = H + 2;
+  for (int i = 0; pass && i < N * C4 * HP * W * 4; ++i) {
+    int l = i % 4, w = i / 4 % W, h = i / 4 / W % HP, c4 = i / 4 / W / HP % C4;
+    int n = i / 4 / W / HP / C4, c = c4 * 4 + l;
+    float expect = 0.f;
+    if (c < C && (h == 0 || h == HP - 1)) {
+      expect = -2.f;
+    } else if (c < C) {
+      float x = src[((n * C + c) * H + h - 1) * W + w];
+      expect = std::max(x * scale[c] + 1, 0.f);
+    }
+    pass = outarr[i] == expect;
+  }
+  delete[] outarr;
+  // per-row bias on a non-packed axis, the edge halo takes the bias of its edge
+  std::vector<float> row_bias = {10, 20, 30};
+  options = Tensor::PermuteOptions();
+  options.padding.before = {0, 0, 1, 0};
+  options.padding.after = {0, 0, 2, 0};
+  options.padding.mode = Tensor::PadMode::Edge;
+  options.epilogue.axis = 'h';
+  options.epilogue.Bias(row_bias);
+  outarr =
+      cpu_permuter.DoPermute("nchw", "nc4hw4", {N, C, H, W}, src.data(), options);
+  pass &= outarr != nullptr;
+  HP = H + 3;
+  for (int i = 0; pass && i < N * C4 * HP * W * 4; ++i) {
+    int l = i % 4, w = i / 4 % W, hp = i / 4 / W % HP, c4 = i / 4 / W / HP % C4;
+    int n = i / 4 / W / HP / C4, c = c4 * 4 + l;
+    int h = std::min(std::max(hp - 1, 0), H - 1);
+    float expect = 0.f;
+    if (c < C) {
+      expect = src[((n * C + c) * H + h) * W + w] + row_bias[h];
+    }
+    pass = outarr[i] == expect;
+  }
+  delete[] outarr;
+  // the non-packed side has c innermost, per-channel params when packing and
+  // unpacking
+  std::vector<float> bias = {-1, -2, -3, -4, -5, -6};
+  options = Tensor::PermuteOptions();
+  options.epilogue.Scale(scale).Bias(bias);
+  outarr = cpu_permuter.DoPermute("nhwc", "nc4hw4", {N, H, W, C}, src.data(),
+                                  options);
+  pass &= outarr != nullptr;
+  for (int i = 0; pass && i < N * C4 * H * W * 4; ++i) {
+    int l = i % 4, w = i / 4 % W, h = i / 4 / W % H, c4 = i / 4 / W / H % C4;
+    int n = i / 4 / W / H / C4, c = c4 * 4 + l;
+    float expect = 0.f;
+    if (c < C) {
+      expect = src[((n * H + h) * W + w) * C + c] * scale[c] + bias[c];
+    }
+    pass = outarr[i] == expect;
+  }
+  delete[] outarr;
+  std::vector<float> packed(N * C4 * H * W * 4);
+  for (size_t i = 0; i < packed.size(); ++i) {
+    packed[i] = i * 1.0 - 70;
+  }
+  outarr = cpu_permuter.DoPermute("nc4hw4", "nhwc", {N, H, W, C},
+                                  packed.data(), options);
+  pass &= outarr != nullptr;
+  for (int i = 0; pass && i < N * H * W * C; ++i) {
+    int c = i % C, w = i / C % W, h = i / C / W % H, n = i / C / W / H;
+    float x = packed[(((n * C4 + c / 4) * H + h) * W + w) * 4 + c % 4];
+    pass = outarr[i] == x * scale[c] + bias[c];
+  }
+  delete[] outarr;
+  // between two packed layouts, the params cover the tail lanes as well
+  std::vector<float> lane_scale = {1, 2, 3, 4, 5, 6, 7, 8};
+  options = Tensor::PermuteOptions();
+  options.epilogue.Scale(lane_scale).Bias({1});
+  outarr = cpu_permuter.DoPermute("nc4hw4", "nhc4w4", {N, C4, H, W, 4},
+                                  packed.data(), options);
+  pass &= outarr != nullptr;
+  for (int i = 0; pass && i < N * H * C4 * W * 4; ++i) {
+    int l = i % 4, w = i / 4 % W, c4 = i / 4 / W % C4, h = i / 4 / W / C4 % H;
+    int n = i / 4 / W / C4 / H;
+    float x = packed[(((n * C4 + c4) * H + h) * W + w) * 4 + l];
+    pass = outarr[i] == x * lane_scale[c4 * 4 + l] + 1;
+  }
+  delete[] outarr;
+  options = Tensor::PermuteOptions();
+  options.epilogue.Scale(scale);
+  pass &= cpu_permuter.DoPermute("nc4hw4", "nhc4w4", {N, C4, H, W, 4},
+                                 packed.data(), options) == nullptr;
+  if (!pass) {
+    std::cout << "test_cpu_epilogue failed\n";
+  }
+  return pass;
+}
+
+// the generated kernel indexes the epilogue tables by channel, and masks the
+// packing tail lanes back to zero before they are written to the image
+bool test_gpu_epilogue() {
+  Tensor::PermuteOpenCL gpu_permuter;
+  Tensor::EpilogueAttribute epilogue;
+  epilogue.Scale({1, 2, 3, 4, 5, 6}).Bias({0.5});
+  auto contains = [](const std::string &code, const std::string &piece) {
+    return code.find(piece) != code.npos;
+  };
+  std::string code =
+      gpu_permuter.DoPermute("nhwc", "nh|c4w4", {1, 3, 5, 6}, nullptr, epilogue)
+          .source_code;
+  bool pass = contains(code, "__constant float EPILOGUE_MUL0[6]") &&
+              contains(code, "__constant float EPILOGUE_ADD0[6]") &&
+              contains(code, "const int4 ci = min(ch, (int4)(5));") &&
+              contains(code, "v = v * (float4)(EPILOGUE_MUL0[ci.s0]") &&
+              contains(code, "v = select(v, (float4)(0.0f), ch >= (int4)(6));");
+  code = gpu_permuter.DoPermute("nh|c4w4", "nhwc", {1, 3, 5, 6}, nullptr,
+                                epilogue)
+             .source_code;
+  pass &= contains(code, "v = v * (float4)(EPILOGUE_MUL0[ci.s0]");
+  // no tail, nothing to mask
+  Tensor::EpilogueAttribute full;
+  full.Scale({1, 2, 3, 4, 5, 6, 7, 8});
+  code = gpu_permuter.DoPermute("nhwc", "nh|c4w4", {1, 3, 5, 8}, nullptr, full)
+             .source_code;
+  pass &= contains(code, "EPILOGUE_MUL0[8]") && !contains(code, "select(v");
+  // a non-packed axis, v has a single channel
+  Tensor::EpilogueAttribute rows;
+  rows.axis = 'H';
+  rows.Bias({10, 20, 30});
+  code = gpu_permuter.DoPermute("nchw", "nh|c4w4", {1, 6, 3, 5}, nullptr, rows)
+             .source_code;
+  pass &= contains(code, "EPILOGUE_ADD0[3]") &&
+          contains(code, "const int ci = dim_H;") &&
+          contains(code, "v = v * EPILOGUE_MUL0[ci] + EPILOGUE_ADD0[ci];") &&
+          contains(code, "v = select(v, (float4)(0.0f), ch >= (int4)(6));");
+  if (!pass) {
+    std::cout << "test_gpu_epilogue failed\n";
+  }
+  return pass;
+}
+
+// folded chains save the expected passes, and chains whose shapes don't
+// continue are broken
+bool test_fold_permute_chain() {
+  Tensor::PermuteCPU cpu_permuter;
+  bool pass = true;
+  std::vector<Tensor::PermuteStep> chain = {{"nchw", "nhwc", {1, 6, 3, 4}},
+                                            {"nhwc", "nc4hw4", {1, 3, 4, 6}}};
+  pass &= cpu_permuter.FoldPermuteChain(chain) == 1 && chain.size() == 1 &&
+          chain[0].to == "nc4hw4" &&
+          chain[0].src_shape == std::vector<int>({1, 6, 3, 4});
+  chain = {{"nc4hw4", "nchw", {1, 6, 3, 4}}, {"nchw", "nc4hw4", {1, 6, 3, 4}}};
+  pass &= cpu_permuter.FoldPermuteChain(chain) == 2 && chain.empty();
+  // the packed->packed step only knows c/4
+  chain = {{"nc4hw4", "nhc4w4", {1, 2, 3, 4, 4}},
+           {"nhc4w4", "nchw", {1, 6, 3, 4}}};
+  pass &= cpu_permuter.FoldPermuteChain(chain) == 1 &&
+          chain[0].src_shape == std::vector<int>({1, 6, 3, 4});
+  chain = {{"nchw", "nhwc", {1, 5, 3, 4}}, {"nhwc", "nchw", {1, 9, 9, 9}}};
+  pass &= cpu_permuter.FoldPermuteChain(chain) == -1;
+  chain = {{"nchw", "nhwc", {1, 5, 3, 4}}, {"nhwc", "nc4hw4", {1, 9, 9, 9}}};
+  pass &= cpu_permuter.FoldPermuteChain(chain) == -1;
+  chain = {{"nc4hw4", "nhc4w4", {1, 2, 3, 4, 4}},
+           {"nhc4w4", "nchw", {1, 9, 3, 4}}};
+  pass &= cpu_permuter.FoldPermuteChain(chain) == -1;
+  if (!pass) {
+    std::cout << "test_fold_permute_chain failed\n";
+  }
+  return pass;
+}
+
 int main() {
-  test_cpu_permute();
+  if (!test_cpu_permute() || !test_cpu_kernel_variants() ||
+      !test_cpu_view() || !test_cpu_box() || !test_cpu_fanout() ||
+      !test_cpu_epilogue() || !test_gpu_epilogue() ||
+      !test_fold_permute_chain()) {
+    return 1;
+  }
   return 0;
-}
\ No newline at end of file
+}
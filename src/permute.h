@@ -1,6 +1,7 @@
 #pragma once
 #include "util.h"
 #include <algorithm>
+#include <cmath>
 #include <iostream>
 #include <map>
 #include <sstream>
@@ -35,6 +36,121 @@ we will use a delimeter '|' to tell how to map a 4-dim tensor to a 2-dim image p
 */
 namespace Tensor {
 
+/*
+describe where a tensor lives in memory, element strides follow the order of
+dimentions in the layout (the '|' delimeter is not a dimention).
+empty strides means a dense row-major buffer, so any slice or channel-split
+view of a bigger tensor can be permuted without a contiguous copy.
+*/
+class StridedMemory {
+public:
+  std::vector<int32_t> strides; // element strides, one for each dimention
+  int32_t offset = 0;           // base offset in elements
+};
+
+enum class PadMode {
+  Constant, // fill the halo with a constant value
+  Edge,     // replicate the nearest edge element
+};
+
+/*
+spatial padding applied while packing, such as producing a conv-ready nc4hw4
+with a zero halo around H and W in one write pass.
+before/after are indexed by src tensor dimentions, empty means no padding.
+the channel tail of a packed tensor is always zero, it's not a halo.
+*/
+class PaddingAttribute {
+public:
+  std::vector<int32_t> before;
+  std::vector<int32_t> after;
+  PadMode mode = PadMode::Constant;
+  float value = 0.f;
+  bool empty() const { return before.empty() && after.empty(); }
+};
+
+enum class EpilogueOp {
+  Scale,     // x * a[c]
+  Bias,      // x + a[c]
+  Normalize, // (x - a[c]) / b[c], a is mean, b is std
+  Relu,      // max(x, 0)
+  Clamp,     // min(max(x, a), b)
+};
+
+class EpilogueStep {
+public:
+  EpilogueOp op;
+  std::vector<float> a; // one for every channel, or a single value for all
+  std::vector<float> b;
+};
+
+/*
+a fused elementwise epilogue applied while permuting, such as a folded
+batch-norm scale/bias or mean/std normalization of image inputs, so it costs no
+extra memory pass. steps are applied in order, per-channel parameters are
+indexed by the src axis `axis`. the packing tail and the constant halo are
+left as they are.
+between two packed layouts, such as nc4hw4->nhc4w4, the channel of the packed
+axis is c4 * alpha + lane, and its tail lanes can't be told from the shape, so
+per-channel parameters cover all the c4 * alpha lanes, the tail included.
+*/
+class EpilogueAttribute {
+public:
+  char axis = 'C';
+  std::vector<EpilogueStep> steps;
+  bool empty() const { return steps.empty(); }
+  EpilogueAttribute &Scale(const std::vector<float> &scale) {
+    steps.push_back({EpilogueOp::Scale, scale, {}});
+    return *this;
+  }
+  EpilogueAttribute &Bias(const std::vector<float> &bias) {
+    steps.push_back({EpilogueOp::Bias, bias, {}});
+    return *this;
+  }
+  EpilogueAttribute &Normalize(const std::vector<float> &mean,
+                               const std::vector<float> &std) {
+    steps.push_back({EpilogueOp::Normalize, mean, std});
+    return *this;
+  }
+  EpilogueAttribute &Relu() {
+    steps.push_back({EpilogueOp::Relu, {}, {}});
+    return *this;
+  }
+  EpilogueAttribute &Clamp(float lo, float hi) {
+    steps.push_back({EpilogueOp::Clamp, {lo}, {hi}});
+    return *this;
+  }
+};
+
+enum class EpilogueStageKind {
+  Affine, // x * mul[c] + add[c], folded from scale/bias/normalize
+  Relu,
+  Clamp,
+};
+
+// the lowered epilogue, which is what engines apply in registers
+class EpilogueStage {
+public:
+  EpilogueStageKind kind;
+  std::vector<float> mul; // one for every channel
+  std::vector<float> add;
+  float lo = 0.f;
+  float hi = 0.f;
+};
+
+//Image2d has two attributes, plus the row pitch of its host staging buffer
+struct ImageAttribute {
+  int32_t width;
+  int32_t height;
+  int32_t row_pitch = 0; // in bytes, 0 means dense rows
+};
+
+enum class LayoutPackMode {
+  None, // non of src or dst tensor is packed
+  From, //from packed tensor to non-packed tensor
+  To, //from non-packed tensor to packed tensor
+  Both,// both packed
+};
+
 /*
 a contenxt data structure to store intermediate infos
 */
@@ -49,15 +165,36 @@ public:
   int32_t dst_alpha_pos;// same 
   std::string from_layout; //
   std::string to_layout;
-  int32_t img_w_from_dim = -1;// for texture memory type, especially for image2d. unused in CPUpermute
+  int32_t img_w_from_dim = -1;// for texture memory type, especially for image2d.
+  ImageAttribute image_attr = {0, 0, 0}; // CPUpermute image2d staging buffer
+  int32_t row_pitch_align = 1; // bytes, staging row pitch is aligned up to it
   bool reversed = false; // if we need  to reverse the transpose linear index
+  LayoutPackMode pack_mode = LayoutPackMode::None; // probed before normallization
+  StridedMemory src_mem; // src tensor memory, strides follow from-layout dims
+  StridedMemory dst_mem; // dst tensor memory, strides follow to-layout dims
+  PaddingAttribute padding; // src_shape is the padded shape if not empty
+  // CPUpermute kernel tables, computed once for a plan
+  std::vector<int32_t> dst_src_dim;  // which src dim every dst dim indexes
+  std::vector<int32_t> dst_src_mult; // index step on src dim, alpha for packed outer dim
+  std::vector<std::vector<int32_t>> src_dim_offsets; // src offset of every src coordinate
+  EpilogueAttribute epilogue; // fused elementwise ops
+  std::vector<EpilogueStage> epilogue_stages; // lowered from epilogue
+  int32_t epilogue_dim = -1; // the src dim per-channel params are indexed by
+  int32_t epilogue_lane_dim = -1; // the lane dim if both layouts pack the axis
+  std::vector<int32_t> epilogue_channel; // CPUpermute, channel of every src coordinate
+  std::vector<int32_t> epilogue_lane_channel; // channel of every lane, added up
 };
 
-enum class LayoutPackMode {
-  None, // non of src or dst tensor is packed
-  From, //from packed tensor to non-packed tensor
-  To, //from non-packed tensor to packed tensor
-  Both,// both packed
+/*
+one permute of a chain, such as a node of the imported graph. src_shape follows
+DoPermute of from->to, e.g. [n, c, h, w] for nchw->nc4hw4 and nc4hw4->nchw,
+[n, c/4, h, w, 4] for nc4hw4->nhc4w4.
+*/
+class PermuteStep {
+public:
+  std::string from;
+  std::string to;
+  std::vector<int> src_shape;
 };
 
 class PermuteBase {
@@ -112,6 +249,10 @@ public:
           digits.push_back(c);
         }
       });
+      // non-packed layout, such as nchw
+      if (digits.empty()) {
+        return true;
+      }
       if (digits.size() != 2 || digits[0] != digits[1]) {
         return false;
       }
@@ -206,6 +347,121 @@ public:
     return 0;
   }
 
+  // locate the epilogue axis in the normallized from-layout, and fold
+  // consecutive scale/bias/normalize steps into one per-channel affine stage.
+  // between two packed layouts the packed axis is split into the c4 dim and
+  // the lane dim, `packed` is that axis.
+  int32_t lower_epilogue(PermuteContext &datag, char packed) {
+    const EpilogueAttribute &epilogue = datag.epilogue;
+    datag.epilogue_stages.clear();
+    datag.epilogue_dim = -1;
+    datag.epilogue_lane_dim = -1;
+    if (epilogue.empty()) {
+      return 0;
+    }
+    int32_t dim = 0;
+    for (char c : datag.from_layout) {
+      // the digit of a normallized non-packed layout is not a src dimention
+      if (isdigit(c)) {
+        continue;
+      }
+      if (c == toupper(epilogue.axis)) {
+        datag.epilogue_dim = dim;
+        break;
+      }
+      dim++;
+    }
+    if (datag.epilogue_dim == -1) {
+      std::cout << "epilogue axis " << epilogue.axis << " not in "
+                << datag.from_layout << "\n";
+      return -1;
+    }
+    int32_t channels = datag.src_shape[datag.epilogue_dim];
+    if (!datag.padding.empty()) {
+      channels -= datag.padding.before[datag.epilogue_dim] +
+                  datag.padding.after[datag.epilogue_dim];
+    }
+    // the normallized layouts can't tell, nhwc->nc4hw4 becomes nhwc4->nchw4.
+    // the lane dim is the last src dim
+    if (datag.pack_mode == LayoutPackMode::Both &&
+        toupper(epilogue.axis) == packed) {
+      int32_t lane = static_cast<int32_t>(datag.src_shape.size()) - 1;
+      if (!datag.padding.empty() &&
+          datag.padding.before[lane] + datag.padding.after[lane] != 0) {
+        std::cout << "epilogue can't index padded lanes\n";
+        return -1;
+      }
+      datag.epilogue_lane_dim = lane;
+      channels *= datag.src_shape[lane];
+    }
+    auto per_channel = [channels](const std::vector<float> &param,
+                                  std::vector<float> &out) -> bool {
+      if (param.size() != 1 && param.size() != static_cast<size_t>(channels)) {
+        std::cout << "epilogue expects 1 or " << channels
+                  << " parameters, got " << param.size() << "\n";
+        return false;
+      }
+      out.resize(channels);
+      for (int32_t c = 0; c < channels; ++c) {
+        out[c] = param.size() == 1 ? param[0] : param[c];
+        if (!std::isfinite(out[c])) {
+          std::cout << "epilogue parameter of channel " << c
+                    << " is not finite\n";
+          return false;
+        }
+      }
+      return true;
+    };
+    std::vector<float> a, b;
+    for (const EpilogueStep &step : epilogue.steps) {
+      if (step.op == EpilogueOp::Relu || step.op == EpilogueOp::Clamp) {
+        EpilogueStage stage;
+        stage.kind = EpilogueStageKind::Relu;
+        if (step.op == EpilogueOp::Clamp) {
+          if (step.a.size() != 1 || step.b.size() != 1) {
+            std::cout << "clamp expects a single lo and hi\n";
+            return -1;
+          }
+          stage.kind = EpilogueStageKind::Clamp;
+          stage.lo = step.a[0];
+          stage.hi = step.b[0];
+        }
+        datag.epilogue_stages.push_back(stage);
+        continue;
+      }
+      if (datag.epilogue_stages.empty() ||
+          datag.epilogue_stages.back().kind != EpilogueStageKind::Affine) {
+        EpilogueStage stage;
+        stage.kind = EpilogueStageKind::Affine;
+        stage.mul.assign(channels, 1.f);
+        stage.add.assign(channels, 0.f);
+        datag.epilogue_stages.push_back(stage);
+      }
+      EpilogueStage &affine = datag.epilogue_stages.back();
+      if (!per_channel(step.a, a) ||
+          (step.op == EpilogueOp::Normalize && !per_channel(step.b, b))) {
+        return -1;
+      }
+      if (step.op == EpilogueOp::Normalize &&
+          std::find(b.begin(), b.end(), 0.f) != b.end()) {
+        std::cout << "epilogue normalize std can't be zero\n";
+        return -1;
+      }
+      for (int32_t c = 0; c < channels; ++c) {
+        if (step.op == EpilogueOp::Scale) {
+          affine.mul[c] *= a[c];
+          affine.add[c] *= a[c];
+        } else if (step.op == EpilogueOp::Bias) {
+          affine.add[c] += a[c];
+        } else {
+          affine.mul[c] /= b[c];
+          affine.add[c] = (affine.add[c] - a[c]) / b[c];
+        }
+      }
+    }
+    return 0;
+  }
+
   int32_t permute_internal(float *src, PermuteContext &datag) {
     // handle nc4hw4
     const std::vector<int> &src_shape = datag.src_shape;
@@ -215,6 +471,8 @@ public:
       return -1;
     }
     LayoutPackMode pack_mode = tensor_pack_mode_probe(from, to);
+    datag.pack_mode = pack_mode;
+    char packed = packed_axis(from);
 
     // canonicalize to upper case
     std::transform(from.begin(), from.end(), from.begin(), std::toupper);
@@ -280,6 +538,202 @@ public:
       datag.dims_to.push_back(c2dim[to[i]]);
       datag.dst_shape.push_back(datag.ceil_src_shape[datag.dims_to.back()]);
     }
+    return lower_epilogue(datag, packed);
+  }
+
+  // the packed shape of a layout from its non-packed shape in axis order,
+  // such as nc4hw4 [n, c, h, w] -> [n, c/4, h, w, 4]
+  std::vector<int32_t> packed_shape(const std::string &layout,
+                                    const std::vector<int32_t> &shape) {
+    std::vector<int32_t> packed;
+    int32_t alpha = layout.back() - '0';
+    size_t dim = 0;
+    for (size_t i = 0; i + 1 < layout.size() && dim < shape.size(); ++i) {
+      if (!isalpha(layout[i])) {
+        continue;
+      }
+      // the first digit follows the packed axis, the last one is alpha
+      bool packed_axis = isdigit(layout[i + 1]) && i + 2 != layout.size();
+      packed.push_back(packed_axis ? CeilDiv(shape[dim], alpha) : shape[dim]);
+      dim++;
+    }
+    packed.push_back(alpha);
+    return packed;
+  }
+
+  // a permute between the same layouts in the same memory type is a no-op
+  bool IsIdentityPermute(const PermuteStep &step) const {
+    return upper_layout(step.from) == upper_layout(step.to);
+  }
+
+  // fold first (a->b) and second (b->c) into a single permute a->c. it's
+  // exact since the packing tail is always zero, e.g. a pack/unpack pair
+  // cancels. returns -1 if a->c can't be served by one permute, such as
+  // between layouts packed on different axes or between two images.
+  int32_t ComposePermute(const PermuteStep &first, const PermuteStep &second,
+                         PermuteStep &composed) {
+    std::map<char, int32_t> sizes;
+    if (link_axis_sizes(first, second, sizes) < 0) {
+      return -1;
+    }
+    const std::string &from = first.from;
+    const std::string &to = second.to;
+    bool from_packed = isdigit(from.back());
+    bool to_packed = isdigit(to.back());
+    std::string from_axes = axis_letters(from);
+    std::string to_axes = axis_letters(to);
+    {
+      auto f = from_axes, t = to_axes;
+      sort(f.begin(), f.end());
+      sort(t.begin(), t.end());
+      if (f != t) {
+        return -1;
+      }
+    }
+    if (upper_layout(from) != upper_layout(to)) {
+      bool from_image = from.find('|') != from.npos;
+      bool to_image = to.find('|') != to.npos;
+      if (from_image && to_image) {
+        return -1;
+      }
+      if (from_packed && to_packed &&
+          (from_image || to_image || from.back() != to.back() ||
+           packed_axis(from) != packed_axis(to))) {
+        return -1;
+      }
+    }
+    composed.from = from;
+    composed.to = to;
+    composed.src_shape.clear();
+    // unpacking takes the shape in to-layout axis order
+    for (char axis : from_packed && !to_packed ? to_axes : from_axes) {
+      composed.src_shape.push_back(sizes[axis]);
+    }
+    if (from_packed && to_packed) {
+      composed.src_shape = packed_shape(from, composed.src_shape);
+    }
+    return 0;
+  }
+
+  // fold a chain of permutes in place, such as nchw->nhwc->nc4hw4 into
+  // nchw->nc4hw4, and drop the ones cancelling out, such as
+  // nc4hw4->nchw->nc4hw4. returns how many permute passes are saved, or -1
+  // for a broken chain
+  int32_t FoldPermuteChain(std::vector<PermuteStep> &chain) {
+    std::map<char, int32_t> sizes;
+    for (size_t i = 1; i < chain.size(); ++i) {
+      if (link_axis_sizes(chain[i - 1], chain[i], sizes) < 0) {
+        std::cout << "broken permute chain at " << i << "\n";
+        return -1;
+      }
+    }
+    std::vector<PermuteStep> folded;
+    for (const PermuteStep &step : chain) {
+      PermuteStep composed;
+      if (!folded.empty() && ComposePermute(folded.back(), step, composed) == 0) {
+        folded.back() = composed;
+      } else {
+        folded.push_back(step);
+      }
+      if (IsIdentityPermute(folded.back())) {
+        folded.pop_back();
+      }
+    }
+    int32_t saved = chain.size() - folded.size();
+    chain.swap(folded);
+    return saved;
+  }
+
+protected:
+  static std::string upper_layout(std::string layout) {
+    std::transform(layout.begin(), layout.end(), layout.begin(),
+                   [](char c) { return static_cast<char>(toupper(c)); });
+    return layout;
+  }
+
+  // axes of a layout in order, upper case, digits and '|' are dropped
+  static std::string axis_letters(const std::string &layout) {
+    std::string axes;
+    for (char c : layout) {
+      if (isalpha(c)) {
+        axes.push_back(toupper(c));
+      }
+    }
+    return axes;
+  }
+
+  // the axis split by packing, such as C of nc4hw4, 0 for a non-packed layout
+  static char packed_axis(const std::string &layout) {
+    auto it = std::find_if(layout.begin(), layout.end(), isdigit);
+    if (it == layout.end() || it == layout.begin() || !isalpha(*(it - 1))) {
+      return 0;
+    }
+    return toupper(*(it - 1));
+  }
+
+  // check that second continues first, the same layout and the same axis
+  // sizes, and report the sizes. a step between two packed layouts only knows
+  // the packed axis rounded up to alpha, the exact size is taken from the
+  // other step if it knows
+  int32_t link_axis_sizes(const PermuteStep &first, const PermuteStep &second,
+                          std::map<char, int32_t> &sizes) {
+    if (upper_layout(first.to) != upper_layout(second.from)) {
+      std::cout << "broken permute chain: " << first.to << " vs "
+                << second.from << "\n";
+      return -1;
+    }
+    std::map<char, int32_t> second_sizes;
+    bool exact = false, second_exact = false;
+    if (step_axis_sizes(first, sizes, exact) < 0 ||
+        step_axis_sizes(second, second_sizes, second_exact) < 0) {
+      return -1;
+    }
+    // the rounded step is the one between packed layouts
+    const std::string &rounded =
+        exact == second_exact ? std::string() : (exact ? second.from : first.from);
+    char split_axis = rounded.empty() ? 0 : packed_axis(rounded);
+    int32_t alpha = rounded.empty() ? 1 : rounded.back() - '0';
+    for (auto &axis_size : sizes) {
+      int32_t size = axis_size.second;
+      int32_t second_size = second_sizes[axis_size.first];
+      if (axis_size.first == split_axis) {
+        size = exact ? AlignUp(size, alpha) : size;
+        second_size = second_exact ? AlignUp(second_size, alpha) : second_size;
+      }
+      if (size != second_size) {
+        std::cout << "broken permute chain: axis " << axis_size.first << " is "
+                  << axis_size.second << " in " << first.from << "->"
+                  << first.to << " but " << second_sizes[axis_size.first]
+                  << " in " << second.from << "->" << second.to << "\n";
+        return -1;
+      }
+    }
+    if (!exact && second_exact) {
+      sizes = second_sizes;
+    }
+    return 0;
+  }
+
+  // the size of every axis from the src_shape of a step. between two packed
+  // layouts only c/4 is known, so the packed axis is rounded up to alpha
+  int32_t step_axis_sizes(const PermuteStep &step,
+                          std::map<char, int32_t> &sizes, bool &exact) {
+    bool from_packed = isdigit(step.from.back());
+    bool to_packed = isdigit(step.to.back());
+    std::string axes = axis_letters(from_packed && !to_packed ? step.to
+                                                              : step.from);
+    exact = !(from_packed && to_packed);
+    if (step.src_shape.size() != axes.size() + (exact ? 0 : 1)) {
+      std::cout << "shape mismatch permute " << step.from << "->" << step.to
+                << "\n";
+      return -1;
+    }
+    char split_axis = exact ? 0 : packed_axis(step.from);
+    int32_t alpha = step.from.back() - '0';
+    sizes.clear();
+    for (size_t i = 0; i < axes.size(); ++i) {
+      sizes[axes[i]] = step.src_shape[i] * (axes[i] == split_axis ? alpha : 1);
+    }
     return 0;
   }
 };
@@ -1,12 +1,82 @@
 #pragma once
 #include "permute.h"
+#include "permute_tuner.h"
 #include <algorithm>
+#include <climits>
+#include <limits>
 #include <cstddef>
+#include <cstdlib>
 #include <ctype.h>
+#include <numeric>
+#include <thread>
 
 
 namespace Tensor {
 
+// where a dst element comes from after mapping it back to src
+enum class SrcElemState {
+  Valid, // a real src element
+  Tail,  // the packing tail, such as nc4hw4 when c%4>0, always zero
+  Halo,  // the constant padding area
+};
+
+// epilogue functors of the row kernel, applied to every real element in
+// registers before it's stored. channel is its index on the epilogue axis.
+// the plain copy, which costs nothing
+class CopyEpilogue {
+public:
+  static constexpr bool kEnabled = false;
+  float operator()(float value, int32_t) const { return value; }
+};
+
+// the lowered stages of a fused epilogue
+class StagedEpilogue {
+public:
+  static constexpr bool kEnabled = true;
+  explicit StagedEpilogue(const std::vector<EpilogueStage> &stages)
+      : stages_(stages) {}
+  float operator()(float value, int32_t channel) const {
+    for (const EpilogueStage &stage : stages_) {
+      switch (stage.kind) {
+      case EpilogueStageKind::Affine:
+        value = value * stage.mul[channel] + stage.add[channel];
+        break;
+      case EpilogueStageKind::Relu:
+        value = std::max(value, 0.f);
+        break;
+      case EpilogueStageKind::Clamp:
+        value = std::min(std::max(value, stage.lo), stage.hi);
+        break;
+      }
+    }
+    return value;
+  }
+
+private:
+  const std::vector<EpilogueStage> &stages_;
+};
+
+/*
+optional attributes of an allocating PermuteCPU::DoPermute.
+padding: permute and pad in one write pass, such as nchw->nc4hw4 with a zero
+halo around H and W.
+epilogue: fused elementwise ops, such as a per-channel scale/bias folded from
+batch-norm.
+image: permute from/to a RGBA staging buffer of image2d, '|' in the layout
+tells which dims are image width, such as nchw->nh|c4w4 or nh|c4w4->nchw.
+image width/height are reported back the same as OpenCL does. when writing an
+image, the staging buffer has height rows of row_pitch bytes, aligned up to
+row_pitch_align. when reading an image, src is the staging buffer and
+row_pitch is its row pitch, 0 means dense rows.
+*/
+class PermuteOptions {
+public:
+  PaddingAttribute padding;
+  EpilogueAttribute epilogue;
+  ImageAttribute *image = nullptr;
+  int32_t row_pitch_align = 1; // bytes
+};
+
 //A implementation for any tensor permute which performed in CPU
 class PermuteCPU : public PermuteBase {
 private:
@@ -27,14 +97,20 @@ private:
     return tensor_index;
   }
   // Given tensor index, to calculate the linear index. But please note that
-  // some linear-index is out-of-bound so we have to return a invalid
-  // index-value. the reason is that we add a new dimention for from-layout, but
+  // some linear-index is out-of-bound so we have to report a invalid
+  // index. the reason is that we add a new dimention for from-layout, but
   // that dimension is in a high probability not divisible.
   // such as [4 3 3 3] -> [4 1 3 3 4]
-  int32_t TensorIndex2linear(const std::vector<int32_t> &ceil_src_shape,
-                             const std::vector<int32_t> &src_shape,
-                             int32_t alpha_split_pos,
-                             const std::vector<int> &tensor_index) {
+  // the linear index is computed with element strides of src_shape, so it also
+  // works for non-contiguous memory. src_shape is the padded shape, an index
+  // falls in the halo is either a constant or clamped to the edge.
+  SrcElemState TensorIndex2linear(const std::vector<int32_t> &ceil_src_shape,
+                                  const std::vector<int32_t> &src_shape,
+                                  int32_t alpha_split_pos,
+                                  const PaddingAttribute &padding,
+                                  const std::vector<int32_t> &src_stride,
+                                  const std::vector<int> &tensor_index,
+                                  int32_t &linear_index) {
     auto dst_ti = tensor_index;
     if (alpha_split_pos >= 0) {
       dst_ti[alpha_split_pos] =
@@ -49,16 +125,23 @@ private:
     if (alpha_split_pos >= 0 &&
         dst_ti[alpha_split_pos] >= src_shape[alpha_split_pos]) {
       // nc4hw4, when c%4>0
-      return -1;
+      return SrcElemState::Tail;
     }
-    int32_t linear_index = 0;
-    size_t stride = 1;
-    for (int32_t dim_index = src_shape.size() - 1; dim_index >= 0;
-         --dim_index) {
-      linear_index += dst_ti[dim_index] * stride;
-      stride *= src_shape[dim_index];
+    if (!padding.empty()) {
+      for (size_t i = 0; i < dst_ti.size(); ++i) {
+        int32_t real_dim = src_shape[i] - padding.before[i] - padding.after[i];
+        int32_t ind = dst_ti[i] - padding.before[i];
+        if (ind >= 0 && ind < real_dim) {
+          dst_ti[i] = ind;
+        } else if (padding.mode == PadMode::Edge) {
+          dst_ti[i] = std::min(std::max(ind, 0), real_dim - 1);
+        } else {
+          return SrcElemState::Halo;
+        }
+      }
     }
-    return linear_index;
+    linear_index = stridedOffset(dst_ti, src_stride);
+    return SrcElemState::Valid;
   }
   //Given a dst tensor index, to calculate src tensor index.
   std::vector<int32_t>
@@ -74,23 +157,592 @@ private:
     }
     return dst_index;
   }
+  // fill dense strides for the memory without explicit strides, and check the
+  // given strides against tensor shape
+  int32_t resolve_strided_memory(StridedMemory &mem,
+                                 const std::vector<int32_t> &shape) {
+    if (mem.strides.empty()) {
+      mem.strides = getStride(shape);
+    }
+    if (mem.strides.size() != shape.size()) {
+      std::cout << "strides " << mem.strides.size()
+                << " mismatch tensor dimentions " << shape.size() << "\n";
+      return -1;
+    }
+    return 0;
+  }
+  // the packed tensor lives in a RGBA staging buffer of image2d if its layout
+  // has a '|', such as nh|c4w4. the same as ImageAttribute in OpenCL, dims
+  // after '|' are image width and dims before it are image height, the packed
+  // dim is the rgba. each row of the staging buffer is aligned to
+  // row_pitch_align bytes, so it can be uploaded by one clEnqueueWriteImage
+  // with that row pitch.
+  int32_t resolve_image_memory(PermuteContext &datagroup) {
+    if (datagroup.img_w_from_dim == -1) {
+      return 0;
+    }
+    const std::vector<int32_t> &dst_shape = datagroup.dst_shape;
+    if (datagroup.dst_alpha_pos < 0 || dst_shape.back() != 4) {
+      std::cout << "image2d requires a rgba packed layout: "
+                << datagroup.to_layout << "\n";
+      return -1;
+    }
+    ImageAttribute &attr = datagroup.image_attr;
+    int32_t width_start_dim = datagroup.img_w_from_dim;
+    int32_t rgba_dim = dst_shape.size() - 1;
+    attr.width = 1;
+    attr.height = 1;
+    for (int32_t i = width_start_dim; i < rgba_dim; i++) {
+      attr.width *= dst_shape[i];
+    }
+    for (int32_t i = 0; i < width_start_dim; i++) {
+      attr.height *= dst_shape[i];
+    }
+    int32_t dense_pitch = attr.width * dst_shape.back() * sizeof(float);
+    if (attr.row_pitch == 0) {
+      attr.row_pitch = AlignUp(dense_pitch, datagroup.row_pitch_align);
+    }
+    if (attr.row_pitch < dense_pitch || attr.row_pitch % sizeof(float) != 0) {
+      std::cout << "illegal image2d row pitch " << attr.row_pitch << "\n";
+      return -1;
+    }
+    // strides of the packed tensor in the staging buffer
+    StridedMemory &image_mem = datagroup.dst_mem;
+    if (!image_mem.strides.empty()) {
+      return 0;
+    }
+    image_mem.strides.assign(dst_shape.size(), 0);
+    int32_t stride_step = 1;
+    for (int32_t i = rgba_dim; i >= width_start_dim; --i) {
+      image_mem.strides[i] = stride_step;
+      stride_step *= dst_shape[i];
+    }
+    stride_step = attr.row_pitch / sizeof(float);
+    for (int32_t i = width_start_dim - 1; i >= 0; --i) {
+      image_mem.strides[i] = stride_step;
+      stride_step *= dst_shape[i];
+    }
+    return 0;
+  }
+  // check the padding and grow src_shape to the padded shape, so the packing
+  // traversal covers the halo as well
+  int32_t prepare_padding(PermuteContext &datagroup) {
+    PaddingAttribute &padding = datagroup.padding;
+    if (padding.empty()) {
+      return 0;
+    }
+    std::vector<int32_t> &src_shape = datagroup.src_shape;
+    if (datagroup.reversed) {
+      std::cout << "padding is not supported when unpacking: "
+                << datagroup.to_layout << "->" << datagroup.from_layout << "\n";
+      return -1;
+    }
+    if (padding.before.empty()) {
+      padding.before.assign(src_shape.size(), 0);
+    }
+    if (padding.after.empty()) {
+      padding.after.assign(src_shape.size(), 0);
+    }
+    if (padding.before.size() != src_shape.size() ||
+        padding.after.size() != src_shape.size()) {
+      std::cout << "padding mismatch tensor dimentions " << src_shape.size()
+                << "\n";
+      return -1;
+    }
+    for (size_t i = 0; i < src_shape.size(); ++i) {
+      if (padding.before[i] < 0 || padding.after[i] < 0) {
+        std::cout << "negative padding at dim " << i << "\n";
+        return -1;
+      }
+      src_shape[i] += padding.before[i] + padding.after[i];
+    }
+    return 0;
+  }
   public:
     float *DoPermute(std::string from, std::string to,
                      const std::vector<int> &src_shape, float *src){
       if (from == to)
         return src;
+      return DoPermute(from, to, src_shape, src, PermuteOptions());
+    }
+    // permute with optional padding, epilogue and image2d staging, they can
+    // be combined. the returned dst is allocated here, its shape is computed
+    // from the padded src shape
+    float *DoPermute(std::string from, std::string to,
+                     const std::vector<int> &src_shape, float *src,
+                     const PermuteOptions &options) {
+      PermuteContext request;
+      request.padding = options.padding;
+      request.epilogue = options.epilogue;
+      if (options.image != nullptr) {
+        request.image_attr = *options.image;
+        request.row_pitch_align = options.row_pitch_align;
+        if (to.find('|') != to.npos) {
+          request.image_attr.row_pitch = 0;
+        }
+      }
+      PlanEntry *plan = prepare_plan(from, to, src_shape, request);
+      if (plan == nullptr) {
+        return nullptr;
+      }
+      const PermuteContext &datagroup = plan->context;
+      if (options.image != nullptr) {
+        if (datagroup.img_w_from_dim == -1) {
+          std::cout << "no image2d delimeter in " << from << "->" << to << "\n";
+          return nullptr;
+        }
+        *options.image = datagroup.image_attr;
+      }
+      size_t elem_size = arrayProduct(datagroup.ceil_src_shape);
+      // the staging buffer of an image has pitched rows
+      if (datagroup.img_w_from_dim != -1 && !datagroup.reversed) {
+        elem_size = static_cast<size_t>(datagroup.image_attr.height) *
+                    datagroup.image_attr.row_pitch / sizeof(float);
+      }
+      float *dst = new float[elem_size];
+      if (execute_plan(*plan, src, dst) < 0) {
+        delete[] dst;
+        return nullptr;
+      }
+      return dst;
+    }
+    // permute a strided source view into a strided destination view in a
+    // single pass, dst must be allocated by caller. for example, permute a
+    // channel slice of a bigger nchw tensor to nhwc without a contiguous copy
+    int32_t DoPermute(std::string from, std::string to,
+                      const std::vector<int> &src_shape, const float *src,
+                      const StridedMemory &src_mem, float *dst,
+                      const StridedMemory &dst_mem,
+                      const PaddingAttribute &padding = PaddingAttribute(),
+                      const EpilogueAttribute &epilogue = EpilogueAttribute()) {
+      PermuteContext request;
+      request.src_mem = src_mem;
+      request.dst_mem = dst_mem;
+      request.padding = padding;
+      request.epilogue = epilogue;
+      PlanEntry *plan = prepare_plan(from, to, src_shape, request);
+      if (plan == nullptr) {
+        return -1;
+      }
+      // base offsets are not a part of the plan, so moving views share a plan
+      return execute_plan(*plan, src + src_mem.offset, dst + dst_mem.offset);
+    }
+    // re-layout only the dst box [start, start + extent) into an existing
+    // full-size dst, such as the changed batch entries or spatial tiles of a
+    // video stream, so an incremental update costs in proportion to the box.
+    // the box is in dst tensor dims, e.g. [n, c/4, h, w, 4] for nc4hw4, the
+    // packing tail inside the box is rewritten as zero. when unpacking, the
+    // box is in the non-packed dims and any channel range is allowed.
+    int32_t DoPermute(std::string from, std::string to,
+                      const std::vector<int> &src_shape, const float *src,
+                      float *dst, const std::vector<int32_t> &start,
+                      const std::vector<int32_t> &extent,
+                      const StridedMemory &src_mem = StridedMemory(),
+                      const StridedMemory &dst_mem = StridedMemory(),
+                      const PaddingAttribute &padding = PaddingAttribute(),
+                      const EpilogueAttribute &epilogue = EpilogueAttribute()) {
+      PermuteContext request;
+      request.src_mem = src_mem;
+      request.dst_mem = dst_mem;
+      request.padding = padding;
+      request.epilogue = epilogue;
+      PlanEntry *plan = prepare_plan(from, to, src_shape, request);
+      if (plan == nullptr) {
+        return -1;
+      }
+      return permute_box(src + src_mem.offset, dst + dst_mem.offset,
+                         plan->context, start, extent, nullptr, plan->config);
+    }
+
+    // fan-out permute: one read of src, several dst layouts. src is walked
+    // tile by tile, and every dst takes its part of a tile while the tile is
+    // hot in cache, e.g. nchw->{nhwc, nc4hw4} for a CPU op and a GPU-style op.
+    // src_shape is the same as DoPermute for a non-packed src, for a packed src
+    // it's the non-packed shape in from-layout axis order, such as [n, c, h, w]
+    // for nc4hw4. dsts are dense and allocated by caller, each one as big as
+    // DoPermute returns for its layout. walked reports how many elements the
+    // walks cover, dst elements when packing (the tail included) and packed
+    // src elements when unpacking, every one is walked once per dst.
+    int32_t DoPermute(std::string from, const std::vector<std::string> &tos,
+                      const std::vector<int> &src_shape, const float *src,
+                      const std::vector<float *> &dsts,
+                      size_t *walked = nullptr) {
+      if (tos.size() != dsts.size()) {
+        std::cout << "fan-out needs one dst for each layout\n";
+        return -1;
+      }
+      bool packed_src = isdigit(from.back());
+      std::vector<int32_t> tile_shape =
+          packed_src ? packed_shape(from, src_shape) : src_shape;
+      // a tile never splits a c4 block of any dst
+      std::vector<int32_t> align(tile_shape.size(), 1);
+      std::vector<const PermuteContext *> plans;
+      for (const std::string &to : tos) {
+        std::vector<int32_t> plan_shape;
+        if (fanout_plan_shape(from, to, src_shape, plan_shape) < 0) {
+          return -1;
+        }
+        PermuteContext request;
+        PlanEntry *plan = prepare_plan(from, to, plan_shape, request);
+        if (plan == nullptr) {
+          return -1;
+        }
+        const PermuteContext &datagroup = plan->context;
+        // walking a packed src, the dst box of a plan is the src tile itself
+        if (datagroup.reversed && datagroup.dst_shape != tile_shape) {
+          std::cout << "can't fan out " << from << "->" << to << "\n";
+          return -1;
+        }
+        if (!datagroup.reversed && datagroup.src_alpha_pos >= 0) {
+          int32_t alpha = datagroup.ceil_src_shape[datagroup.src_alpha_pos + 1];
+          int32_t &dim_align = align[datagroup.src_alpha_pos];
+          dim_align = dim_align * alpha / std::gcd(dim_align, alpha);
+        }
+        plans.push_back(&datagroup);
+      }
+      // tiles are cut on the outer dims, the inner dims stay whole. an outer
+      // dim is stepped by its alignment, such as the c of nchw->nc4hw4 cut on
+      // h, so a c4 block is still written by one tile. the tile budget leaves
+      // room for the aligned outer dims
+      std::vector<size_t> outer_align(tile_shape.size() + 1, 1);
+      for (size_t i = 0; i < tile_shape.size(); ++i) {
+        outer_align[i + 1] = outer_align[i] * align[i];
+      }
+      int32_t tile_dim = tile_shape.size() - 1;
+      size_t inner = 1;
+      while (tile_dim > 0 && inner * tile_shape[tile_dim] *
+                                     outer_align[tile_dim] <=
+                                 kFanoutTileSize) {
+        inner *= tile_shape[tile_dim];
+        tile_dim--;
+      }
+      int32_t chunk = kFanoutTileSize / outer_align[tile_dim] / inner /
+                      align[tile_dim] * align[tile_dim];
+      chunk = std::min(std::max(chunk, align[tile_dim]), tile_shape[tile_dim]);
+      size_t outer_count = 1;
+      for (int32_t i = 0; i < tile_dim; ++i) {
+        outer_count *= CeilDiv(tile_shape[i], align[i]);
+      }
+      std::vector<int32_t> start(tile_shape.size(), 0);
+      std::vector<int32_t> extent = tile_shape;
+      std::vector<int32_t> walk_start, walk_extent;
+      if (walked != nullptr) {
+        *walked = 0;
+      }
+      for (size_t outer = 0; outer < outer_count; ++outer) {
+        size_t remain = outer;
+        for (int32_t i = tile_dim - 1; i >= 0; --i) {
+          int32_t steps = CeilDiv(tile_shape[i], align[i]);
+          start[i] = remain % steps * align[i];
+          extent[i] = std::min(align[i], tile_shape[i] - start[i]);
+          remain /= steps;
+        }
+        for (int32_t c0 = 0; c0 < tile_shape[tile_dim]; c0 += chunk) {
+          start[tile_dim] = c0;
+          extent[tile_dim] = std::min(chunk, tile_shape[tile_dim] - c0);
+          for (size_t i = 0; i < plans.size(); ++i) {
+            const PermuteContext &datagroup = *plans[i];
+            if (datagroup.reversed) {
+              walk_start = start;
+              walk_extent = extent;
+            } else {
+              src_box_to_dst_box(datagroup, start, extent, walk_start,
+                                 walk_extent);
+            }
+            RowWalk walk =
+                make_row_walk(datagroup, 0, walk_start, walk_extent);
+            permute_rows(src, dsts[i], datagroup, walk, 0, walk.outer_count);
+            if (walked != nullptr) {
+              *walked += arrayProduct(walk_extent);
+            }
+          }
+        }
+      }
+      return 0;
+    }
+
+    // the tuner picks a kernel for every new plan, nullptr means the default
+    // kernel. the tuner must outlive this permuter
+    void SetTuner(PermuteTuner *tuner) { tuner_ = tuner; }
+    // offline tuning run of a dense permute, the winner is recorded in tuner
+    int32_t Tune(std::string from, std::string to,
+                 const std::vector<int> &src_shape, PermuteTuner &tuner) {
+      PermuteContext request;
+      PlanEntry *plan = prepare_plan(from, to, src_shape, request);
+      if (plan == nullptr) {
+        return -1;
+      }
+      size_t elem_size = arrayProduct(plan->context.ceil_src_shape);
+      std::vector<float> src(elem_size, 0.f), dst(elem_size, 0.f);
+      plan->config = tuner.Tune(
+          plan->plan_key, elem_size, [&](const PermuteKernelConfig &config) {
+            run_kernel(src.data(), dst.data(), plan->context, config);
+          });
+      plan->tuned = true;
+      return 0;
+    }
+
+  private:
+    friend class PermutedView;
+    // a normallized context with its kernel choice, cached by all its inputs
+    class PlanEntry {
+    public:
+      PermuteContext context;
+      std::string plan_key; // the key in tuning database, see tuning_key
+      PermuteKernelConfig config;
+      bool tuned = false;
+    };
+
+    // the fast kernels walk dst row by row, row_dim is the innermost dst dim.
+    // block_dim is blocked together with row_dim, for a tiled walk it's the
+    // dst dim with the smallest src stride, so both src and dst are touched
+    // in cache-line-sized pieces. the rest dims are outer dims.
+    // only the dst box [start, start + extent) is walked, a dst index is
+    // written at (index - dst_origin) * dst_stride.
+    class RowWalk {
+    public:
+      int32_t row_dim = 0;
+      int32_t block_dim = -1;
+      int32_t tile = 0;
+      std::vector<int32_t> outer_dims;
+      size_t outer_count = 1;
+      std::vector<int32_t> start;
+      std::vector<int32_t> extent;
+      std::vector<int32_t> dst_stride;
+      std::vector<int32_t> dst_origin;
+    };
+
+    std::string plan_cache_key(const std::string &from, const std::string &to,
+                               const std::vector<int> &src_shape,
+                               const PermuteContext &request) {
+      std::ostringstream oss;
+      // floats are keyed exactly
+      oss.precision(std::numeric_limits<float>::max_digits10);
+      auto put = [&oss](const std::vector<int32_t> &v) {
+        for (auto x : v) {
+          oss << x << ",";
+        }
+        oss << ";";
+      };
+      oss << from << "->" << to << ";";
+      put(src_shape);
+      put(request.src_mem.strides);
+      put(request.dst_mem.strides);
+      put(request.padding.before);
+      put(request.padding.after);
+      oss << static_cast<int>(request.padding.mode) << ";"
+          << request.padding.value << ";" << request.image_attr.row_pitch
+          << ";" << request.row_pitch_align << ";";
+      const EpilogueAttribute &epilogue = request.epilogue;
+      if (!epilogue.empty()) {
+        oss << epilogue.axis << ";";
+        for (const EpilogueStep &step : epilogue.steps) {
+          oss << static_cast<int>(step.op) << ":";
+          for (float x : step.a) {
+            oss << x << ",";
+          }
+          oss << ":";
+          for (float x : step.b) {
+            oss << x << ",";
+          }
+          oss << ";";
+        }
+      }
+      return oss.str();
+    }
+
+    // the shape-independent part of plan_cache_key, plans sharing it share a
+    // kernel choice in tuning database (the size bucket is added by tuner).
+    // such as "nchw->nhwc" for a dense plan, "nchw->nhwc;src:0123+gap;pad"
+    // for a padded channel slice. a stride pattern is the order of dims from
+    // the outermost stride, and whether the innermost one is a gap
+    std::string tuning_key(const std::string &from, const std::string &to,
+                           const PermuteContext &request) {
+      std::ostringstream oss;
+      oss << from << "->" << to;
+      auto put = [&oss](const char *name, const std::vector<int32_t> &strides) {
+        if (strides.empty()) {
+          return;
+        }
+        std::vector<int32_t> order(strides.size());
+        std::iota(order.begin(), order.end(), 0);
+        std::stable_sort(order.begin(), order.end(),
+                         [&strides](int32_t a, int32_t b) {
+                           return std::abs(strides[a]) > std::abs(strides[b]);
+                         });
+        oss << ";" << name << ":";
+        for (auto d : order) {
+          oss << d;
+        }
+        if (std::abs(strides[order.back()]) != 1) {
+          oss << "+gap";
+        }
+      };
+      put("src", request.src_mem.strides);
+      put("dst", request.dst_mem.strides);
+      if (!request.padding.empty()) {
+        oss << ";pad";
+      }
+      if (request.image_attr.row_pitch != 0 || request.row_pitch_align > 1) {
+        oss << ";pitch";
+      }
+      if (!request.epilogue.empty()) {
+        oss << ";epilogue";
+      }
+      return oss.str();
+    }
+
+    PlanEntry *prepare_plan(const std::string &from, const std::string &to,
+                            const std::vector<int> &src_shape,
+                            PermuteContext &request) {
+      std::string key = plan_cache_key(from, to, src_shape, request);
+      auto it = plan_cache_.find(key);
+      if (it != plan_cache_.end()) {
+        return &it->second;
+      }
+      std::string tuned_key = tuning_key(from, to, request);
+      request.src_mem.offset = 0;
+      request.dst_mem.offset = 0;
+      if (prepare_context(from, to, src_shape, request) < 0) {
+        return nullptr;
+      }
+      prepare_kernel_tables(request);
+      PlanEntry &plan = plan_cache_[key];
+      plan.context = std::move(request);
+      plan.plan_key = tuned_key;
+      return &plan;
+    }
+
+    int32_t execute_plan(PlanEntry &plan, const float *src, float *dst) {
+      if (!plan.tuned) {
+        size_t elem_size = arrayProduct(plan.context.ceil_src_shape);
+        if (tuner_ == nullptr ||
+            tuner_->Lookup(plan.plan_key, elem_size, plan.config)) {
+        } else if (tuner_->online()) {
+          // the candidates write the same dst, the last run is the result
+          plan.config = tuner_->Tune(
+              plan.plan_key, elem_size, [&](const PermuteKernelConfig &config) {
+                run_kernel(src, dst, plan.context, config);
+              });
+        }
+        plan.tuned = true;
+      }
+      return run_kernel(src, dst, plan.context, plan.config);
+    }
+
+    // the dst box covering a box of src_shape dims, a box on the packed src
+    // dim covers whole c4 blocks
+    void src_box_to_dst_box(const PermuteContext &datagroup,
+                            const std::vector<int32_t> &start,
+                            const std::vector<int32_t> &extent,
+                            std::vector<int32_t> &dst_start,
+                            std::vector<int32_t> &dst_extent) {
+      dst_start.clear();
+      dst_extent.clear();
+      for (size_t i = 0; i < datagroup.dst_shape.size(); ++i) {
+        int32_t d = datagroup.dst_src_dim[i];
+        int32_t mult = datagroup.dst_src_mult[i];
+        if (d != datagroup.src_alpha_pos) {
+          dst_start.push_back(start[d]);
+          dst_extent.push_back(extent[d]);
+        } else if (mult > 1) {
+          // c4 of nc4hw4 covering the channel box
+          dst_start.push_back(start[d] / mult);
+          dst_extent.push_back(CeilDiv(start[d] + extent[d], mult) -
+                               start[d] / mult);
+        } else {
+          dst_start.push_back(0);
+          dst_extent.push_back(datagroup.dst_shape[i]);
+        }
+      }
+    }
+
+    // permute the dst box [start, start + extent) only, the box is in dst
+    // tensor dims, which are the non-packed dims when unpacking. dst is the
+    // full dst tensor if box_mem is nullptr, otherwise it's a buffer of the
+    // box described by box_mem, empty strides means a dense box.
+    int32_t permute_box(const float *src, float *dst,
+                        const PermuteContext &datagroup,
+                        const std::vector<int32_t> &start,
+                        const std::vector<int32_t> &extent,
+                        const StridedMemory *box_mem,
+                        const PermuteKernelConfig &config =
+                            PermuteKernelConfig()) {
+      int32_t tile = config.kernel == PermuteKernel::Tiled ||
+                             config.kernel == PermuteKernel::Threaded
+                         ? config.tile
+                         : 0;
+      const std::vector<int32_t> &box_shape =
+          datagroup.reversed ? datagroup.src_shape : datagroup.dst_shape;
+      if (start.size() != box_shape.size() ||
+          extent.size() != box_shape.size()) {
+        std::cout << "box mismatch tensor dimentions " << box_shape.size()
+                  << "\n";
+        return -1;
+      }
+      for (size_t i = 0; i < box_shape.size(); ++i) {
+        if (start[i] < 0 || extent[i] <= 0 ||
+            start[i] + extent[i] > box_shape[i]) {
+          std::cout << "box out of range at dim " << i << "\n";
+          return -1;
+        }
+      }
+      std::vector<int32_t> box_stride;
+      if (box_mem != nullptr) {
+        box_stride =
+            box_mem->strides.empty() ? getStride(extent) : box_mem->strides;
+        if (box_stride.size() != box_shape.size()) {
+          std::cout << "box strides mismatch tensor dimentions\n";
+          return -1;
+        }
+      }
+      if (!datagroup.reversed) {
+        RowWalk walk = make_row_walk(datagroup, tile, start, extent);
+        if (box_mem != nullptr) {
+          walk.dst_stride = box_stride;
+          walk.dst_origin = start;
+        }
+        run_walk(src, dst, datagroup, walk, config);
+        return 0;
+      }
+      // when unpacking, we walk the packed src which covers the box, and the
+      // src coordinates out of the box are treated as packing tail, so they
+      // are never written back.
+      PermuteContext boxed = datagroup;
+      for (size_t d = 0; d < boxed.src_dim_offsets.size(); ++d) {
+        int32_t stride =
+            box_mem != nullptr ? box_stride[d] : datagroup.src_mem.strides[d];
+        int32_t origin = box_mem != nullptr ? start[d] : 0;
+        std::vector<int32_t> &offsets = boxed.src_dim_offsets[d];
+        int32_t dim_size = static_cast<int32_t>(offsets.size());
+        for (int32_t x = 0; x < dim_size; ++x) {
+          bool in_box = x >= start[d] && x < start[d] + extent[d];
+          offsets[x] = in_box ? (x - origin) * stride : kTailOffset;
+        }
+      }
+      std::vector<int32_t> walk_start, walk_extent;
+      src_box_to_dst_box(datagroup, start, extent, walk_start, walk_extent);
+      RowWalk walk = make_row_walk(boxed, tile, walk_start, walk_extent);
+      run_walk(src, dst, boxed, walk, config);
+      return 0;
+    }
+
+    int32_t prepare_context(const std::string &from, const std::string &to,
+                            const std::vector<int> &src_shape,
+                            PermuteContext &datagroup) {
       auto layout_valid_checker = [](const std::string &ly) -> bool {
         size_t n = std::count_if(ly.begin(), ly.end(), [](const char &c) -> bool {
-          if (!isalnum(c)) {
+          // '|' is the image2d dimention delimeter
+          if (!isalnum(c) && c != '|') {
             return true;
           }
+          return false;
         });
         return n==0;
       };
       if (!layout_valid_checker(from) || !layout_valid_checker(to)) {
-        return nullptr;
+        return -1;
       }
-      PermuteContext datagroup;
       bool need_reverse_permute = isdigit(from.back()) && (!isdigit(to.back()));
       datagroup.from_layout = from;
       datagroup.to_layout = to;
@@ -100,37 +752,417 @@ private:
       // to reverse the tensor-index, it's more easier to handle the tail elements during packing
       if (need_reverse_permute) {
         swap(datagroup.from_layout, datagroup.to_layout);
+        std::swap(datagroup.src_mem, datagroup.dst_mem);
         datagroup.reversed = true;
       }
-      if (permute_internal(src, datagroup) < 0) {
-        return nullptr;
+      if (prepare_padding(datagroup) < 0) {
+        return -1;
+      }
+      if (permute_internal(nullptr, datagroup) < 0) {
+        return -1;
+      }
+      if (resolve_image_memory(datagroup) < 0) {
+        return -1;
+      }
+      // after normallization, src_mem always describes src_shape and dst_mem
+      // describes dst_shape, whatever it's reversed or not. the padding is
+      // virtual, src memory still has the unpadded shape
+      if (resolve_strided_memory(datagroup.src_mem, src_shape) < 0 ||
+          resolve_strided_memory(datagroup.dst_mem, datagroup.dst_shape) < 0) {
+        return -1;
+      }
+      return 0;
+    }
+
+    // precompute how dst dims index src dims, and the src offset of every
+    // coordinate on each src dim, including the packing tail and the halo.
+    // then a dst row costs one table lookup per element.
+    void prepare_kernel_tables(PermuteContext &datagroup) {
+      const std::vector<int32_t> &ceil_src_shape = datagroup.ceil_src_shape;
+      const std::vector<int32_t> &src_shape = datagroup.src_shape;
+      const PaddingAttribute &padding = datagroup.padding;
+      int32_t alpha_pos = datagroup.src_alpha_pos;
+      size_t dst_dims = datagroup.dims_to.size();
+      datagroup.dst_src_dim.assign(dst_dims, 0);
+      datagroup.dst_src_mult.assign(dst_dims, 1);
+      for (size_t i = 0; i < dst_dims; ++i) {
+        int32_t ceil_dim = datagroup.dims_to[i];
+        if (alpha_pos < 0 || ceil_dim < alpha_pos) {
+          datagroup.dst_src_dim[i] = ceil_dim;
+        } else if (ceil_dim == alpha_pos) {
+          // c4 of nc4hw4, steps alpha channels
+          datagroup.dst_src_dim[i] = alpha_pos;
+          datagroup.dst_src_mult[i] = ceil_src_shape[alpha_pos + 1];
+        } else if (ceil_dim == alpha_pos + 1) {
+          datagroup.dst_src_dim[i] = alpha_pos;
+        } else {
+          datagroup.dst_src_dim[i] = ceil_dim - 1;
+        }
+      }
+      datagroup.src_dim_offsets.assign(src_shape.size(), {});
+      int32_t src_dims = static_cast<int32_t>(src_shape.size());
+      for (int32_t d = 0; d < src_dims; ++d) {
+        int32_t extent = src_shape[d];
+        if (d == alpha_pos) {
+          extent = ceil_src_shape[d] * ceil_src_shape[d + 1];
+        }
+        int32_t before = padding.empty() ? 0 : padding.before[d];
+        int32_t real_dim =
+            padding.empty() ? src_shape[d]
+                            : src_shape[d] - before - padding.after[d];
+        int32_t stride = datagroup.src_mem.strides[d];
+        std::vector<int32_t> &offsets = datagroup.src_dim_offsets[d];
+        offsets.resize(extent);
+        for (int32_t x = 0; x < extent; ++x) {
+          int32_t ind = x - before;
+          if (x >= src_shape[d]) {
+            offsets[x] = kTailOffset;
+          } else if (ind >= 0 && ind < real_dim) {
+            offsets[x] = ind * stride;
+          } else if (padding.mode == PadMode::Edge) {
+            offsets[x] = std::min(std::max(ind, 0), real_dim - 1) * stride;
+          } else {
+            offsets[x] = kHaloOffset;
+          }
+        }
+      }
+      // the epilogue channel of every coordinate, the halo of edge padding
+      // takes the channel of its edge. between two packed layouts the c4 dim
+      // steps alpha channels and the lane dim adds its lane
+      int32_t d = datagroup.epilogue_dim;
+      if (d < 0) {
+        return;
       }
+      auto channel_table = [&](int32_t dim, int32_t step,
+                               std::vector<int32_t> &table) {
+        int32_t before = padding.empty() ? 0 : padding.before[dim];
+        int32_t real_dim =
+            padding.empty() ? src_shape[dim]
+                            : src_shape[dim] - before - padding.after[dim];
+        table.resize(datagroup.src_dim_offsets[dim].size());
+        for (size_t x = 0; x < table.size(); ++x) {
+          int32_t ind = static_cast<int32_t>(x) - before;
+          table[x] = std::min(std::max(ind, 0), real_dim - 1) * step;
+        }
+      };
+      int32_t lane = datagroup.epilogue_lane_dim;
+      channel_table(d, lane < 0 ? 1 : src_shape[lane],
+                    datagroup.epilogue_channel);
+      datagroup.epilogue_lane_channel.clear();
+      if (lane >= 0) {
+        channel_table(lane, 1, datagroup.epilogue_lane_channel);
+      }
+    }
+
+    int32_t run_kernel(const float *src, float *dst,
+                       const PermuteContext &datagroup,
+                       const PermuteKernelConfig &config) {
+      // the reference kernel doesn't fuse epilogue, the row kernel serves it
+      if (config.kernel == PermuteKernel::Generic &&
+          datagroup.epilogue_stages.empty()) {
+        return permute_strided(src, dst, datagroup);
+      }
+      int32_t tile = config.kernel == PermuteKernel::Incremental ? 0 : config.tile;
+      RowWalk walk = make_row_walk(datagroup, tile);
+      run_walk(src, dst, datagroup, walk, config);
+      return 0;
+    }
+
+    // walk the rows, Threaded kernel splits outer rows among threads.
+    // Generic kernel has no row walk, it's served serially here
+    void run_walk(const float *src, float *dst, const PermuteContext &datagroup,
+                  const RowWalk &walk, const PermuteKernelConfig &config) {
+      if (config.kernel != PermuteKernel::Threaded || config.threads <= 1 ||
+          walk.outer_count <= 1) {
+        permute_rows(src, dst, datagroup, walk, 0, walk.outer_count);
+        return;
+      }
+      size_t threads = std::min<size_t>(config.threads, walk.outer_count);
+      size_t chunk = CeilDiv(walk.outer_count, threads);
+      std::vector<std::thread> workers;
+      for (size_t begin = 0; begin < walk.outer_count; begin += chunk) {
+        size_t end = std::min(begin + chunk, walk.outer_count);
+        workers.emplace_back([&, begin, end]() {
+          permute_rows(src, dst, datagroup, walk, begin, end);
+        });
+      }
+      for (auto &worker : workers) {
+        worker.join();
+      }
+    }
+
+    RowWalk make_row_walk(const PermuteContext &datagroup, int32_t tile,
+                          const std::vector<int32_t> &start = {},
+                          const std::vector<int32_t> &extent = {}) {
+      RowWalk walk;
+      const std::vector<int32_t> &dst_shape = datagroup.dst_shape;
+      int32_t dst_dims = dst_shape.size();
+      walk.row_dim = dst_dims - 1;
+      walk.tile = tile;
+      walk.start = start.empty() ? std::vector<int32_t>(dst_dims, 0) : start;
+      walk.extent = extent.empty() ? dst_shape : extent;
+      walk.dst_stride = datagroup.dst_mem.strides;
+      walk.dst_origin.assign(dst_dims, 0);
+      if (dst_dims >= 2) {
+        walk.block_dim = dst_dims - 2;
+      }
+      if (tile > 0) {
+        int64_t min_stride = -1;
+        for (int32_t i = 0; i < walk.row_dim; ++i) {
+          int64_t stride =
+              std::abs(static_cast<int64_t>(
+                  datagroup.src_mem.strides[datagroup.dst_src_dim[i]])) *
+              datagroup.dst_src_mult[i];
+          if (walk.extent[i] > 1 && (min_stride < 0 || stride < min_stride)) {
+            min_stride = stride;
+            walk.block_dim = i;
+          }
+        }
+      }
+      for (int32_t i = 0; i < dst_dims; ++i) {
+        if (i != walk.row_dim && i != walk.block_dim) {
+          walk.outer_dims.push_back(i);
+          walk.outer_count *= walk.extent[i];
+        }
+      }
+      return walk;
+    }
+
+    void permute_rows(const float *src, float *dst,
+                      const PermuteContext &datagroup, const RowWalk &walk,
+                      size_t outer_begin, size_t outer_end) {
+      if (datagroup.epilogue_stages.empty()) {
+        permute_rows(src, dst, datagroup, walk, outer_begin, outer_end,
+                     CopyEpilogue());
+      } else {
+        permute_rows(src, dst, datagroup, walk, outer_begin, outer_end,
+                     StagedEpilogue(datagroup.epilogue_stages));
+      }
+    }
+
+    template <typename Epilogue>
+    void permute_rows(const float *src, float *dst,
+                      const PermuteContext &datagroup, const RowWalk &walk,
+                      size_t outer_begin, size_t outer_end,
+                      const Epilogue &epilogue) {
+      const std::vector<int32_t> &dst_stride = walk.dst_stride;
+      const std::vector<int32_t> &dst_origin = walk.dst_origin;
+      const std::vector<int32_t> &dst_src_dim = datagroup.dst_src_dim;
+      const std::vector<int32_t> &dst_src_mult = datagroup.dst_src_mult;
+      const std::vector<std::vector<int32_t>> &offsets =
+          datagroup.src_dim_offsets;
+      const float fill = datagroup.padding.value;
+      int32_t row_dim = walk.row_dim;
+      int32_t block_dim = walk.block_dim;
+      int32_t row_begin = walk.start[row_dim];
+      int32_t row_end = row_begin + walk.extent[row_dim];
+      int32_t block_begin = block_dim >= 0 ? walk.start[block_dim] : 0;
+      int32_t block_end =
+          block_dim >= 0 ? block_begin + walk.extent[block_dim] : 1;
+      int32_t row_tile = walk.tile > 0 ? walk.tile : row_end - row_begin;
+      int32_t block_tile = walk.tile > 0 ? walk.tile : block_end - block_begin;
+      int32_t row_src_dim = dst_src_dim[row_dim];
+      int32_t row_mult = dst_src_mult[row_dim];
+      int32_t row_stride = dst_stride[row_dim];
+      int32_t block_src_dim = block_dim >= 0 ? dst_src_dim[block_dim] : -1;
+      int32_t block_mult = block_dim >= 0 ? dst_src_mult[block_dim] : 0;
+      int32_t block_stride = block_dim >= 0 ? dst_stride[block_dim] : 0;
+      int32_t block_origin = block_dim >= 0 ? dst_origin[block_dim] : 0;
+      std::vector<int32_t> coord(offsets.size(), 0);
+      int32_t src_dims = static_cast<int32_t>(coord.size());
+      for (size_t outer = outer_begin; outer < outer_end; ++outer) {
+        // locate the outer dims in dst and src, they are fixed for all rows
+        std::fill(coord.begin(), coord.end(), 0);
+        int32_t dst_outer = -dst_origin[row_dim] * row_stride;
+        size_t remain = outer;
+        for (auto it = walk.outer_dims.rbegin(); it != walk.outer_dims.rend();
+             ++it) {
+          int32_t index = walk.start[*it] + remain % walk.extent[*it];
+          remain /= walk.extent[*it];
+          coord[dst_src_dim[*it]] += index * dst_src_mult[*it];
+          dst_outer += (index - dst_origin[*it]) * dst_stride[*it];
+        }
+        SrcElemState outer_state = SrcElemState::Valid;
+        int32_t src_outer = 0;
+        for (int32_t d = 0; d < src_dims; ++d) {
+          if (d == row_src_dim || d == block_src_dim) {
+            continue;
+          }
+          accumulate_offset(offsets[d][coord[d]], src_outer, outer_state);
+        }
+        for (int32_t b0 = block_begin; b0 < block_end; b0 += block_tile) {
+          int32_t b1 = std::min(b0 + block_tile, block_end);
+          for (int32_t r0 = row_begin; r0 < row_end; r0 += row_tile) {
+            int32_t r1 = std::min(r0 + row_tile, row_end);
+            for (int32_t b = b0; b < b1; ++b) {
+              // locate the row in dst and src
+              int32_t dst_row = dst_outer + (b - block_origin) * block_stride;
+              SrcElemState row_state = outer_state;
+              int32_t src_row = src_outer;
+              int32_t row_coord = coord[row_src_dim];
+              if (block_src_dim == row_src_dim) {
+                // c4 and 4 of nc4hw4 index the same src dim
+                row_coord += b * block_mult;
+              } else if (block_src_dim >= 0) {
+                accumulate_offset(
+                    offsets[block_src_dim][coord[block_src_dim] +
+                                           b * block_mult],
+                    src_row, row_state);
+              }
+              const int32_t *row_offsets =
+                  offsets[row_src_dim].data() + row_coord;
+              // epilogue channel, per element if the row walks the epilogue
+              // axis, otherwise fixed for the row
+              const int32_t *row_channels = nullptr;
+              int32_t row_channel = 0;
+              if constexpr (Epilogue::kEnabled) {
+                auto add_channel = [&](const std::vector<int32_t> &table,
+                                       int32_t d) {
+                  if (d == row_src_dim) {
+                    row_channels = table.data() + row_coord;
+                  } else {
+                    row_channel += table[coord[d] + (d == block_src_dim
+                                                         ? b * block_mult
+                                                         : 0)];
+                  }
+                };
+                add_channel(datagroup.epilogue_channel, datagroup.epilogue_dim);
+                if (datagroup.epilogue_lane_dim >= 0) {
+                  add_channel(datagroup.epilogue_lane_channel,
+                              datagroup.epilogue_lane_dim);
+                }
+              }
+              auto channel = [&](int32_t r) {
+                return row_channels != nullptr
+                           ? row_channel + row_channels[r * row_mult]
+                           : row_channel;
+              };
+              // read every element in packed tensor and write back to
+              // non-packed tensor
+              if (datagroup.reversed) {
+                if (row_state != SrcElemState::Valid) {
+                  continue;
+                }
+                for (int32_t r = r0; r < r1; ++r) {
+                  int32_t offset = row_offsets[r * row_mult];
+                  if (offset > kHaloOffset) {
+                    dst[src_row + offset] =
+                        epilogue(src[dst_row + r * row_stride], channel(r));
+                  }
+                }
+              } else if (row_state == SrcElemState::Valid) {
+                for (int32_t r = r0; r < r1; ++r) {
+                  int32_t offset = row_offsets[r * row_mult];
+                  dst[dst_row + r * row_stride] =
+                      offset > kHaloOffset
+                          ? epilogue(src[src_row + offset], channel(r))
+                      : offset == kTailOffset ? 0
+                                              : fill;
+                }
+              } else {
+                // the packing tail is always zero, even in a halo row
+                for (int32_t r = r0; r < r1; ++r) {
+                  int32_t offset = row_offsets[r * row_mult];
+                  dst[dst_row + r * row_stride] =
+                      row_state == SrcElemState::Tail || offset == kTailOffset
+                          ? 0
+                          : fill;
+                }
+              }
+            }
+          }
+        }
+      }
+    }
+
+    // add a src dim offset to a row, tail wins over halo
+    static void accumulate_offset(int32_t offset, int32_t &src_row,
+                                  SrcElemState &state) {
+      if (offset == kTailOffset) {
+        state = SrcElemState::Tail;
+      } else if (offset == kHaloOffset) {
+        if (state == SrcElemState::Valid) {
+          state = SrcElemState::Halo;
+        }
+      } else {
+        src_row += offset;
+      }
+    }
+
+    int32_t permute_strided(const float *src, float *dst,
+                            const PermuteContext &datagroup) {
+      const StridedMemory &src_mem = datagroup.src_mem;
+      const StridedMemory &dst_mem = datagroup.dst_mem;
       //
       // do permute
       int dst_index = 0;
       size_t elem_size = arrayProduct(datagroup.ceil_src_shape);
-      float *dst = new float[elem_size];
       while (dst_index < elem_size) {
         // dst tensorindex
         auto tensorindex = linear2TensorIndex(datagroup.dst_shape, dst_index);
         //convert to src tensor index.
         auto dst_ti = transformTensorIndex(tensorindex, datagroup.dims_to);
-        int32_t src_index =
-            TensorIndex2linear(datagroup.ceil_src_shape, src_shape,
-                               datagroup.src_alpha_pos, dst_ti);
+        int32_t src_index = 0;
+        SrcElemState src_state = TensorIndex2linear(
+            datagroup.ceil_src_shape, datagroup.src_shape,
+            datagroup.src_alpha_pos, datagroup.padding, src_mem.strides,
+            dst_ti, src_index);
+        int32_t dst_offset = stridedOffset(tensorindex, dst_mem.strides);
         // Here is the key to process reverse permute,  read every dst_index in
         // packed tensor and write back to non-packed tensor
         if (datagroup.reversed) {
-          if (src_index >= 0) {
-            dst[src_index] = src[dst_index];
+          if (src_state == SrcElemState::Valid) {
+            dst[src_index] = src[dst_offset];
           }
+        } else if (src_state == SrcElemState::Valid) {
+          dst[dst_offset] = src[src_index];
         } else {
-          dst[dst_index] = src_index >= 0 ? src[src_index] : 0;
+          dst[dst_offset] =
+              src_state == SrcElemState::Halo ? datagroup.padding.value : 0;
         }
         dst_index++;
       }
-      return dst;
+      return 0;
     }
+
+    // the src_shape DoPermute expects for from->to, given the non-packed
+    // shape of src in from-layout axis order
+    int32_t fanout_plan_shape(const std::string &from, const std::string &to,
+                              const std::vector<int32_t> &shape,
+                              std::vector<int32_t> &plan_shape) {
+      std::string from_axes = axis_letters(from);
+      if (from_axes.size() != shape.size()) {
+        std::cout << "shape mismatch layout " << from << "\n";
+        return -1;
+      }
+      if (!isdigit(from.back())) {
+        plan_shape = shape;
+      } else if (isdigit(to.back())) {
+        plan_shape = packed_shape(from, shape);
+      } else {
+        // unpacking takes the shape in to-layout axis order
+        plan_shape.clear();
+        for (char c : axis_letters(to)) {
+          size_t pos = from_axes.find(c);
+          if (pos == from_axes.npos) {
+            std::cout << __LINE__ << "error permute " << from << "->" << to
+                      << "\n";
+            return -1;
+          }
+          plan_shape.push_back(shape[pos]);
+        }
+      }
+      return 0;
+    }
+
+    // elements of a fan-out src tile, it fits in L2 together with its dst parts
+    static constexpr size_t kFanoutTileSize = 65536;
+    // a src coordinate without real data in src_dim_offsets
+    static constexpr int32_t kTailOffset = INT32_MIN;
+    static constexpr int32_t kHaloOffset = INT32_MIN + 1;
+
+    std::map<std::string, PlanEntry> plan_cache_;
+    PermuteTuner *tuner_ = nullptr;
 };
 
 
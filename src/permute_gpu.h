@@ -1,12 +1,9 @@
 #include "permute.h"
+#include <cmath>
+#include <limits>
 
 namespace Tensor {
 
-//Image2d has two attributes
-struct ImageAttribute {
-  int32_t width;
-  int32_t height;
-};
 class OpenClCode {
 public:
   std::string source_code;
@@ -20,6 +17,8 @@ memory type.
 for buffer->buffer, the same with CPU
 for buffer->image2d or image2d-buffer, it's special to read/write data
 image2d->image2d is not support, becuase, image2d requires the minimal data-width is 4 elements
+a fused epilogue is emitted as code on the loaded vec4, right before it's stored,
+its per-channel parameters are __constant tables in the program.
 
 */
 class PermuteOpenCL :public PermuteBase{
@@ -44,8 +43,8 @@ public:
     }
   };
   OpenClCode DoPermute(std::string from, std::string to,
-                       const std::vector<int> &src_shape,
-                       float *src) {
+                       const std::vector<int> &src_shape, float *src,
+                       const EpilogueAttribute &epilogue = EpilogueAttribute()) {
     OpenClCode clartifacts;
     //we use '|' to represent memory location of tensor is Image2D or not
     auto fp = from.find('|');
@@ -58,6 +57,7 @@ public:
     datagroup.from_layout = from;
     datagroup.to_layout = to;
     datagroup.src_shape = src_shape;
+    datagroup.epilogue = epilogue;
     if (fp != from.npos && tp == to.npos) {
       swap(datagroup.from_layout, datagroup.to_layout);
       datagroup.reversed = true;
@@ -84,6 +84,96 @@ public:
   }
 
 private:
+  static std::string float_literal(float x) {
+    if (std::isnan(x)) {
+      return "NAN";
+    }
+    if (std::isinf(x)) {
+      return x > 0 ? "INFINITY" : "-INFINITY";
+    }
+    std::ostringstream oss;
+    oss.precision(std::numeric_limits<float>::max_digits10);
+    oss << std::showpoint << x << "f";
+    return oss.str();
+  }
+
+  // per-channel tables of the affine epilogue stages
+  std::string epilogue_constants_opencl(const PermuteContext &datagroup) {
+    std::ostringstream oss;
+    const std::vector<EpilogueStage> &stages = datagroup.epilogue_stages;
+    for (size_t i = 0; i < stages.size(); ++i) {
+      if (stages[i].kind != EpilogueStageKind::Affine) {
+        continue;
+      }
+      for (int32_t k = 0; k < 2; ++k) {
+        const std::vector<float> &table = k == 0 ? stages[i].mul : stages[i].add;
+        oss << "__constant float EPILOGUE_" << (k == 0 ? "MUL" : "ADD") << i
+            << "[" << table.size() << "] = {";
+        for (size_t c = 0; c < table.size(); ++c) {
+          oss << (c == 0 ? "" : ", ") << float_literal(table[c]);
+        }
+        oss << "};\n";
+      }
+    }
+    return oss.str();
+  }
+
+  // apply the epilogue stages on vec4 v in registers. when the epilogue axis
+  // is the packed one, every lane is a channel, otherwise v has one channel.
+  // lanes of the packing tail are set back to zero if keep_tail_zero
+  std::string epilogue_codegen_opencl(const PermuteContext &datagroup,
+                                      const std::vector<std::string> &var_load,
+                                      const std::string &space_head,
+                                      bool keep_tail_zero) {
+    std::ostringstream oss;
+    const std::vector<EpilogueStage> &stages = datagroup.epilogue_stages;
+    if (stages.empty()) {
+      return "";
+    }
+    int32_t dim = datagroup.epilogue_dim;
+    int32_t alpha_pos = datagroup.src_alpha_pos;
+    bool per_lane = dim == alpha_pos;
+    // the packing tail exists whatever the epilogue axis is
+    keep_tail_zero = keep_tail_zero && datagroup.src_shape[alpha_pos] % 4 != 0;
+    oss << space_head << "// fused epilogue\n";
+    if (per_lane || keep_tail_zero) {
+      const std::string &base = var_load[alpha_pos];
+      oss << space_head << "const int4 ch = (int4)(" << base << ", " << base
+          << " + 1, " << base << " + 2, " << base << " + 3);\n";
+    }
+    if (per_lane) {
+      oss << space_head << "const int4 ci = min(ch, (int4)("
+          << datagroup.src_shape[dim] - 1 << "));\n";
+    } else {
+      oss << space_head << "const int ci = " << var_load[dim] << ";\n";
+    }
+    auto table = [per_lane](const std::string &name) {
+      if (!per_lane) {
+        return name + "[ci]";
+      }
+      return "(float4)(" + name + "[ci.s0], " + name + "[ci.s1], " + name +
+             "[ci.s2], " + name + "[ci.s3])";
+    };
+    for (size_t i = 0; i < stages.size(); ++i) {
+      const EpilogueStage &stage = stages[i];
+      if (stage.kind == EpilogueStageKind::Affine) {
+        oss << space_head << "v = v * "
+            << table("EPILOGUE_MUL" + std::to_string(i)) << " + "
+            << table("EPILOGUE_ADD" + std::to_string(i)) << ";\n";
+      } else if (stage.kind == EpilogueStageKind::Relu) {
+        oss << space_head << "v = fmax(v, (float4)(0.0f));\n";
+      } else {
+        oss << space_head << "v = clamp(v, " << float_literal(stage.lo) << ", "
+            << float_literal(stage.hi) << ");\n";
+      }
+    }
+    if (keep_tail_zero) {
+      oss << space_head << "v = select(v, (float4)(0.0f), ch >= (int4)("
+          << datagroup.src_shape[alpha_pos] << "));\n";
+    }
+    return oss.str();
+  }
+
   //
   std::string
   generate_image_index_tensorindex(const std::vector<int32_t> &shape_width,
@@ -235,6 +325,7 @@ private:
     }
     out_artifacts.kernel_name +=
         datagroup.reversed ? datagroup.from_layout : datagroup.to_layout;
+    kernel_oss << epilogue_constants_opencl(datagroup);
     // generate kernel function signature
     kernel_oss << "__kernel void " << out_artifacts.kernel_name << "(";
     if (intype.Image) {
@@ -349,12 +440,16 @@ private:
                  << src_shape[datagroup.src_alpha_pos] << "-"
                  << var_load[datagroup.src_alpha_pos] << "); \n";
       // kernel_oss << "printf(\"%.0f,%.0f,%.0f,%.0f   \",v.x,v.y,v.z,v.w);\n";
+      kernel_oss << epilogue_codegen_opencl(datagroup, var_load, space_head,
+                                            true);
       kernel_oss << space_head
                  << "WI_F(output, (int2)(x, y), CONVERT_FLOAT4(v));\n";
     } else if (intype.Image) {
-      kernel_oss
-          << space_head
-          << "const float4 v = convert_float4(RI_F(data, (int2)(x, y)));\n";
+      kernel_oss << space_head
+                 << (datagroup.epilogue_stages.empty() ? "const " : "")
+                 << "float4 v = convert_float4(RI_F(data, (int2)(x, y)));\n";
+      kernel_oss << epilogue_codegen_opencl(datagroup, var_load, space_head,
+                                            false);
       kernel_oss << space_head
                  << "SAFE_SCATTER_STG_VEC4(output, base_index, stride,"
                  << src_shape[datagroup.src_alpha_pos] << "-"
@@ -0,0 +1,226 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace Tensor {
+
+// kernel variants of PermuteCPU, the fastest one depends on shape and machine
+enum class PermuteKernel {
+  Generic,     // index arithmetic per element, the reference implementation
+  Incremental, // row by row, per-dimention offset tables
+  Tiled,       // 2d blocking on the innermost two dst dims
+  Threaded,    // Incremental/Tiled with outer rows split among threads
+};
+
+class PermuteKernelConfig {
+public:
+  PermuteKernel kernel = PermuteKernel::Incremental;
+  int32_t tile = 0;    // block size of Tiled/Threaded, 0 means no blocking
+  int32_t threads = 1; // worker count of Threaded
+};
+
+/*
+auto-tuner on top of the PermuteCPU plan cache.
+the first time a plan is used (or in an offline tuning run), every candidate
+kernel is benchmarked and the winner is recorded in a tuning database, keyed by
+cpu model, plan key (from->to, plus stride pattern, padding, image pitch and
+epilogue if any) and size bucket (log2 of elements).
+the database is a text file, one record per line:
+  cpu_model \t plan_key \t size_bucket \t kernel \t tile \t threads
+records of other cpu models are kept as-is, so one file can serve many machines.
+*/
+class PermuteTuner {
+public:
+  PermuteTuner() = default;
+  // load the database at startup, a missing file is an empty database
+  explicit PermuteTuner(const std::string &db_path) : db_path_(db_path) {
+    Load(db_path_);
+  }
+  ~PermuteTuner() {
+    if (dirty_ && !db_path_.empty()) {
+      Save(db_path_);
+    }
+  }
+
+  int32_t Load(const std::string &path) {
+    std::ifstream fin(path);
+    if (!fin) {
+      return -1;
+    }
+    std::string line;
+    while (std::getline(fin, line)) {
+      std::vector<std::string> fields;
+      std::istringstream iss(line);
+      std::string field;
+      while (std::getline(iss, field, '\t')) {
+        fields.push_back(field);
+      }
+      // a corrupt or hand-edited record is skipped
+      int32_t kernel = 0;
+      PermuteKernelConfig config;
+      if (fields.size() != 6 || !parse_int(fields[3], kernel) ||
+          !parse_int(fields[4], config.tile) ||
+          !parse_int(fields[5], config.threads) ||
+          kernel < static_cast<int32_t>(PermuteKernel::Generic) ||
+          kernel > static_cast<int32_t>(PermuteKernel::Threaded) ||
+          config.tile < 0 || config.threads < 1) {
+        continue;
+      }
+      config.kernel = static_cast<PermuteKernel>(kernel);
+      database_[fields[0] + '\t' + fields[1] + '\t' + fields[2]] = config;
+    }
+    return 0;
+  }
+
+  int32_t Save(const std::string &path) {
+    std::ofstream fout(path);
+    if (!fout) {
+      std::cout << "can't write tuning database " << path << "\n";
+      return -1;
+    }
+    for (auto &record : database_) {
+      const PermuteKernelConfig &config = record.second;
+      fout << record.first << '\t' << static_cast<int>(config.kernel) << '\t'
+           << config.tile << '\t' << config.threads << "\n";
+    }
+    dirty_ = false;
+    return 0;
+  }
+
+  bool Lookup(const std::string &plan_key, size_t elem_size,
+              PermuteKernelConfig &config) const {
+    auto it = database_.find(record_key(plan_key, elem_size));
+    if (it == database_.end()) {
+      return false;
+    }
+    config = it->second;
+    return true;
+  }
+
+  void Record(const std::string &plan_key, size_t elem_size,
+              const PermuteKernelConfig &config) {
+    database_[record_key(plan_key, elem_size)] = config;
+    dirty_ = true;
+  }
+
+  // benchmark all candidates with runner, record and return the fastest one
+  PermuteKernelConfig
+  Tune(const std::string &plan_key, size_t elem_size,
+       const std::function<void(const PermuteKernelConfig &)> &runner) {
+    PermuteKernelConfig best;
+    double best_time = -1;
+    for (const PermuteKernelConfig &config : Candidates(elem_size)) {
+      runner(config); // warm up
+      double cost = -1;
+      for (int32_t i = 0; i < repeats_; ++i) {
+        auto start = std::chrono::steady_clock::now();
+        runner(config);
+        std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - start;
+        if (cost < 0 || elapsed.count() < cost) {
+          cost = elapsed.count();
+        }
+      }
+      if (best_time < 0 || cost < best_time) {
+        best_time = cost;
+        best = config;
+      }
+    }
+    Record(plan_key, elem_size, best);
+    return best;
+  }
+
+  std::vector<PermuteKernelConfig> Candidates(size_t elem_size) const {
+    std::vector<PermuteKernelConfig> candidates;
+    PermuteKernelConfig config;
+    config.kernel = PermuteKernel::Generic;
+    // the reference kernel is hopeless on anything but tiny tensors
+    if (elem_size <= 1024) {
+      candidates.push_back(config);
+    }
+    config.kernel = PermuteKernel::Incremental;
+    candidates.push_back(config);
+    config.kernel = PermuteKernel::Tiled;
+    for (int32_t tile : {8, 16, 32, 64}) {
+      config.tile = tile;
+      candidates.push_back(config);
+    }
+    int32_t max_threads =
+        std::max(1, static_cast<int32_t>(std::thread::hardware_concurrency()));
+    config.kernel = PermuteKernel::Threaded;
+    for (int32_t threads = 2; threads <= max_threads; threads *= 2) {
+      for (int32_t tile : {0, 32}) {
+        config.tile = tile;
+        config.threads = threads;
+        candidates.push_back(config);
+      }
+    }
+    return candidates;
+  }
+
+  static int32_t SizeBucket(size_t elem_size) {
+    int32_t bucket = 0;
+    while (elem_size > 1) {
+      elem_size >>= 1;
+      bucket++;
+    }
+    return bucket;
+  }
+
+  static std::string CpuModel() {
+    static const std::string model = [] {
+      std::ifstream fin("/proc/cpuinfo");
+      std::string line;
+      while (std::getline(fin, line)) {
+        if (line.compare(0, 10, "model name") == 0) {
+          auto pos = line.find(':');
+          if (pos != line.npos && pos + 2 <= line.size()) {
+            return line.substr(pos + 2);
+          }
+        }
+      }
+      return std::string("unknown");
+    }();
+    return model;
+  }
+
+  void set_repeats(int32_t repeats) { repeats_ = repeats; }
+  // tune a plan the first time it's used if there is no record
+  void set_online(bool online) { online_ = online; }
+  bool online() const { return online_; }
+
+private:
+  // the whole field must be an integer
+  static bool parse_int(const std::string &field, int32_t &value) {
+    std::istringstream iss(field);
+    int64_t x = 0;
+    if (!(iss >> x) || !iss.eof() || x < INT32_MIN || x > INT32_MAX) {
+      return false;
+    }
+    value = static_cast<int32_t>(x);
+    return true;
+  }
+
+  std::string record_key(const std::string &plan_key, size_t elem_size) const {
+    return CpuModel() + '\t' + plan_key + '\t' +
+           std::to_string(SizeBucket(elem_size));
+  }
+
+  std::map<std::string, PermuteKernelConfig> database_;
+  std::string db_path_;
+  int32_t repeats_ = 3;
+  bool online_ = true;
+  bool dirty_ = false;
+};
+
+}
@@ -0,0 +1,143 @@
+#pragma once
+#include "permute_cpu.h"
+
+namespace Tensor {
+
+/*
+a lazy permuted tensor, nothing is copied when it's built.
+a consumer that reads only part of the result, or reads permuted indices
+directly, maps a dst index to its src address through the plan's offset tables,
+and materializes only the sub-box it touches.
+dst indices follow the dst layout, such as [n, c/4, h, w, 4] for nc4hw4 and
+[n, c, h, w] for nc4hw4->nchw.
+the view refers to a plan cached in permuter, so permuter must outlive it.
+a fused epilogue is applied by At and Materialize, Address is the raw src.
+*/
+class PermutedView {
+public:
+  PermutedView(PermuteCPU &permuter, std::string from, std::string to,
+               const std::vector<int> &src_shape, const float *src,
+               const StridedMemory &src_mem = StridedMemory(),
+               const PaddingAttribute &padding = PaddingAttribute(),
+               const EpilogueAttribute &epilogue = EpilogueAttribute())
+      : permuter_(&permuter), src_(src + src_mem.offset) {
+    PermuteContext request;
+    request.src_mem = src_mem;
+    request.padding = padding;
+    request.epilogue = epilogue;
+    PermuteCPU::PlanEntry *plan =
+        permuter.prepare_plan(from, to, src_shape, request);
+    if (plan == nullptr) {
+      return;
+    }
+    plan_ = &plan->context;
+    shape_ = plan_->reversed ? plan_->src_shape : plan_->dst_shape;
+  }
+
+  bool valid() const { return plan_ != nullptr; }
+  // dst tensor shape
+  const std::vector<int32_t> &shape() const { return shape_; }
+
+  // the src element of a dst index, nullptr for the packing tail, the halo,
+  // or an index out of range
+  const float *Address(const std::vector<int32_t> &dst_index) const {
+    int32_t offset = 0, channel = 0;
+    if (locate(dst_index, offset, channel) != SrcElemState::Valid) {
+      return nullptr;
+    }
+    return src_ + offset;
+  }
+
+  // the value of a dst element, including the packing tail and the halo
+  float At(const std::vector<int32_t> &dst_index) const {
+    int32_t offset = 0, channel = 0;
+    SrcElemState state = locate(dst_index, offset, channel);
+    if (state == SrcElemState::Valid) {
+      if (plan_->epilogue_stages.empty()) {
+        return src_[offset];
+      }
+      return StagedEpilogue(plan_->epilogue_stages)(src_[offset], channel);
+    }
+    return state == SrcElemState::Halo ? plan_->padding.value : 0.f;
+  }
+
+  // materialize the dst box [start, start + extent) into a dense tile, or a
+  // strided one if tile_mem has strides
+  int32_t Materialize(const std::vector<int32_t> &start,
+                      const std::vector<int32_t> &extent, float *tile,
+                      const StridedMemory &tile_mem = StridedMemory()) const {
+    if (!valid()) {
+      return -1;
+    }
+    return permuter_->permute_box(src_, tile + tile_mem.offset, *plan_, start,
+                                  extent, &tile_mem);
+  }
+
+  // materialize the full tensor, dense unless dst_mem has strides
+  int32_t Materialize(float *dst,
+                      const StridedMemory &dst_mem = StridedMemory()) const {
+    return Materialize(std::vector<int32_t>(shape_.size(), 0), shape_, dst,
+                       dst_mem);
+  }
+
+private:
+  SrcElemState locate(const std::vector<int32_t> &dst_index, int32_t &offset,
+                      int32_t &channel) const {
+    if (!valid() || dst_index.size() != shape_.size()) {
+      return SrcElemState::Tail;
+    }
+    for (size_t i = 0; i < shape_.size(); ++i) {
+      if (dst_index[i] < 0 || dst_index[i] >= shape_[i]) {
+        return SrcElemState::Tail;
+      }
+    }
+    const PermuteContext &plan = *plan_;
+    offset = 0;
+    if (plan.reversed) {
+      // dst index is the non-packed index, split the packed dim back into
+      // c4 and 4 to address the packed src
+      for (size_t i = 0; i < plan.dst_shape.size(); ++i) {
+        int32_t d = plan.dst_src_dim[i];
+        int32_t ind = dst_index[d];
+        if (d == plan.src_alpha_pos) {
+          int32_t alpha = plan.ceil_src_shape[d + 1];
+          ind = plan.dst_src_mult[i] > 1 ? ind / alpha : ind % alpha;
+        }
+        offset += ind * plan.dst_mem.strides[i];
+      }
+      if (plan.epilogue_dim >= 0) {
+        channel = plan.epilogue_channel[dst_index[plan.epilogue_dim]];
+      }
+      return SrcElemState::Valid;
+    }
+    std::vector<int32_t> coord(plan.src_dim_offsets.size(), 0);
+    for (size_t i = 0; i < dst_index.size(); ++i) {
+      coord[plan.dst_src_dim[i]] += dst_index[i] * plan.dst_src_mult[i];
+    }
+    SrcElemState state = SrcElemState::Valid;
+    for (size_t d = 0; d < coord.size(); ++d) {
+      int32_t dim_offset = plan.src_dim_offsets[d][coord[d]];
+      if (dim_offset == PermuteCPU::kTailOffset) {
+        return SrcElemState::Tail;
+      } else if (dim_offset == PermuteCPU::kHaloOffset) {
+        state = SrcElemState::Halo;
+      } else {
+        offset += dim_offset;
+      }
+    }
+    if (plan.epilogue_dim >= 0) {
+      channel = plan.epilogue_channel[coord[plan.epilogue_dim]];
+    }
+    if (plan.epilogue_lane_dim >= 0) {
+      channel += plan.epilogue_lane_channel[coord[plan.epilogue_lane_dim]];
+    }
+    return state;
+  }
+
+  PermuteCPU *permuter_ = nullptr;
+  const PermuteContext *plan_ = nullptr;
+  const float *src_ = nullptr;
+  std::vector<int32_t> shape_;
+};
+
+}
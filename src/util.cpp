@@ -19,5 +19,14 @@ std::vector<int32_t> getStride(const std::vector<int32_t> &shape) {
   return stride;
 }
 
+int32_t stridedOffset(const std::vector<int32_t> &index,
+                      const std::vector<int32_t> &stride) {
+  int32_t offset = 0;
+  for (size_t i = 0; i < index.size(); ++i) {
+    offset += index[i] * stride[i];
+  }
+  return offset;
+}
+
 
 }
\ No newline at end of file
@@ -6,12 +6,19 @@
 namespace Tensor {
 int32_t arrayProduct(const std::vector<int32_t> &shape);
 std::vector<int32_t> getStride(const std::vector<int32_t> &shape);
+int32_t stridedOffset(const std::vector<int32_t> &index,
+                      const std::vector<int32_t> &stride);
 
 template <typename T, typename E = std::enable_if_t<std::is_integral_v<T>>>
 T CeilDiv(T a, T b) {
   return (a - 1) / b + 1;
 }
 
+template <typename T, typename E = std::enable_if_t<std::is_integral_v<T>>>
+T AlignUp(T a, T b) {
+  return CeilDiv(a, b) * b;
+}
+
 #define assert(cond)                                                           \
   {                                                                            \
     if (cond) {                                                                \